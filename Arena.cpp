@@ -0,0 +1,79 @@
+#include "Arena.h"
+
+#include <sys/mman.h>
+#include <cstdint>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+// Free buffers by size class. Classes below HUGEPAGE are powers of two
+// carved out of shared chunks and stay mapped; whole chunks are unmapped
+// once more than ARENARETAIN of them are idle.
+static mutex arenaMtx;
+static map<size_t, vector<void*>> freeBlocks;
+static size_t retained = 0;
+
+static size_t sizeClass(size_t bytes)
+{
+	if(bytes >= HUGEPAGE)
+		return (bytes + HUGEPAGE - 1) & ~(HUGEPAGE - 1);
+	size_t c = ARENAMIN;
+	while(c < bytes)
+		c <<= 1;
+	return c;
+}
+
+static void *mapChunks(size_t bytes)
+{
+	void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(p != MAP_FAILED)
+		return p;
+
+	// no reserved huge pages: map a little more, trim it to a huge page
+	// boundary and let the kernel back it with transparent ones
+	auto raw = static_cast<char*>(mmap(nullptr, bytes + HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if(raw == MAP_FAILED)
+		return nullptr;
+	auto start = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + HUGEPAGE - 1) & ~(HUGEPAGE - 1));
+	if(start > raw)
+		munmap(raw, start - raw);
+	munmap(start + bytes, raw + HUGEPAGE - start);
+	madvise(start, bytes, MADV_HUGEPAGE);
+	return start;
+}
+
+void *arenaAllocate(size_t bytes)
+{
+	size_t size = sizeClass(bytes);
+	lock_guard<mutex> lock(arenaMtx);
+	auto &blocks = freeBlocks[size];
+	if(blocks.empty())
+	{
+		auto chunk = static_cast<char*>(mapChunks(max(size, HUGEPAGE)));
+		if(!chunk)
+			return nullptr;
+		if(size >= HUGEPAGE)
+			return chunk;
+		for(size_t offset = HUGEPAGE; offset > 0; offset -= size)
+			blocks.push_back(chunk + offset - size);
+		retained += HUGEPAGE;
+	}
+	void *p = blocks.back();
+	blocks.pop_back();
+	retained -= size;
+	return p;
+}
+
+void arenaRelease(void *p, size_t bytes)
+{
+	size_t size = sizeClass(bytes);
+	lock_guard<mutex> lock(arenaMtx);
+	if(size >= HUGEPAGE && retained + size > ARENARETAIN)
+	{
+		munmap(p, size);
+		return;
+	}
+	freeBlocks[size].push_back(p);
+	retained += size;
+}
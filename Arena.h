@@ -0,0 +1,56 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <cstddef>
+#include <new>
+
+using namespace std;
+
+// Backing store for the large, long lived buffers: tile columns and the
+// per-thread orbit caches. Memory comes in 2MB aligned chunks, from
+// explicit huge pages if the system has some reserved and otherwise with
+// transparent huge pages requested, so the scattered writes of a merge do
+// not miss the TLB on every pixel. Freed buffers are kept for the next
+// allocation of the same size, which lets a resumed or restarted job skip
+// faulting its memory in again. Requests below ARENAMIN use the heap.
+constexpr size_t ARENAMIN = 64 * 1024;
+constexpr size_t HUGEPAGE = 2 * 1024 * 1024;
+constexpr size_t ARENARETAIN = 1024UL * 1024 * 1024;
+
+void *arenaAllocate(size_t bytes);
+void arenaRelease(void *p, size_t bytes);
+
+template<typename T>
+struct ArenaAllocator
+{
+	typedef T value_type;
+
+	ArenaAllocator() = default;
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U>&) {}
+
+	T *allocate(size_t n)
+	{
+		if(n * sizeof(T) < ARENAMIN)
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		auto p = arenaAllocate(n * sizeof(T));
+		if(!p)
+			throw bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		if(n * sizeof(T) < ARENAMIN)
+			::operator delete(p);
+		else
+			arenaRelease(p, n * sizeof(T));
+	}
+
+	template<typename U>
+	bool operator==(const ArenaAllocator<U>&) const { return true; }
+	template<typename U>
+	bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+#endif
@@ -1,4 +1,6 @@
 #include "Calculator.h"
+#include "RenderManager.h"
+#include "Isa.h"
 #include <chrono>
 #include <unistd.h>
 
@@ -8,8 +10,74 @@ using namespace std::literals;
 constexpr int THREADCOUNT = 7;
 constexpr int MEMPERTHREAD = 128*1024*1024;
 constexpr int CACHEPERTHREAD = MEMPERTHREAD / sizeof(ThreadData::cache[0]);
+// the convergence metric looks at the largest pyramid level this small
+constexpr int CONVERGENCESIZE = 256;
 
-Calculator::Calculator(char *formula, int w, int h, int steps, int div, int skip, double cw, double ch, bool *ok, Storage *store)
+template<typename T, typename S>
+static ISAINLINE void mergeColumn(T *__restrict dst, S *__restrict src, int n)
+{
+	for(int i = 0; i < n; ++i)
+		dst[i] += src[i];
+	fill_n(src, n, 0);
+}
+
+static ISAINLINE void mergeWords(uint64_t *dst, uint64_t *src, int n) { mergeColumn(dst, src, n); }
+static ISAINLINE void mergeNarrow(uint64_t *dst, uint32_t *src, int n) { mergeColumn(dst, src, n); }
+static ISAINLINE void mergeFloats(double *dst, double *src, int n) { mergeColumn(dst, src, n); }
+ISAVARIANTS(void, mergeWords, (uint64_t *dst, uint64_t *src, int n), (dst, src, n))
+ISAVARIANTS(void, mergeNarrow, (uint64_t *dst, uint32_t *src, int n), (dst, src, n))
+ISAVARIANTS(void, mergeFloats, (double *dst, double *src, int n), (dst, src, n))
+
+// Applies the contributions of one tile. The channel set and the width of
+// the hits column are fixed at compile time, so a profile only pays for the
+// channels it stores.
+template<uint32_t CH, typename H>
+static void applyContributions(PixelColumns &xdat, H *hits, const Contribution *p, const Contribution *end, const decltype(ThreadData::cache) &cache)
+{
+	for(; p != end; ++p)
+	{
+		int px = p->pixel;
+		if(p->start)
+		{
+			if(CH & channelBit(STARTHITS))
+				xdat.startHits[px]++;
+			if(CH & channelBit(STARTSTEPS))
+				xdat.startSteps[px] += p->kDiv;
+			continue;
+		}
+
+		complex<double> c;
+		int j;
+		tie(ignore, c, j) = cache[p->entry];
+		hits[px]++;
+		if(CH & channelBit(REALORIG))
+			xdat.realOrig[px] += c.real();
+		if(CH & channelBit(IMAGORIG))
+			xdat.imagOrig[px] += c.imag();
+		if(CH & channelBit(STEPS))
+			xdat.steps[px] += p->kDiv;
+		if(CH & channelBit(REACHEDSTEP))
+			xdat.reachedStep[px] += j;
+		if((CH & (channelBit(REALLAST) | channelBit(IMAGLAST))) && j)
+		{
+			if(CH & channelBit(REALLAST))
+				xdat.realLast[px] += c.real();
+			if(CH & channelBit(IMAGLAST))
+				xdat.imagLast[px] += c.imag();
+		}
+	}
+}
+
+template<uint32_t CH>
+static void applyTile(PixelColumns &xdat, const Contribution *p, const Contribution *end, const decltype(ThreadData::cache) &cache)
+{
+	if(xdat.hits32)
+		applyContributions<CH>(xdat, xdat.hits32, p, end, cache);
+	else
+		applyContributions<CH>(xdat, xdat.hits, p, end, cache);
+}
+
+Calculator::Calculator(char *formula, int w, int h, int steps, int div, int skip, double cw, double ch, int shard, int shards, const char *profile, const char *sampling, const OrbitFilter &filter, const vector<TargetSpec> &targetSpecs, bool *ok, Storage *store)
 {
 	if(!FormulaManager::formulas.count(formula))
 	{
@@ -17,54 +85,318 @@ Calculator::Calculator(char *formula, int w, int h, int steps, int div, int skip
 		*ok = false;
 		return;
 	}
+	if(shards < 1 || shard < 0 || shard >= shards)
+	{
+		fprintf(stderr, "Shard %d/%d does not exist.\n", shard, shards);
+		*ok = false;
+		return;
+	}
+	if(!findProfile(profile))
+	{
+		fprintf(stderr, "Profile '%s' not available.\nKnown profiles:", profile);
+		for(auto &p : profiles)
+			fprintf(stderr, " %s", p.name);
+		fprintf(stderr, "\n");
+		*ok = false;
+		return;
+	}
+	if(!isSampling(sampling))
+	{
+		fprintf(stderr, "Sampling '%s' not available.\nKnown samplings:", sampling);
+		for(auto &name : samplings)
+			fprintf(stderr, " %s", name.c_str());
+		fprintf(stderr, "\n");
+		*ok = false;
+		return;
+	}
+	if(filter.maxLength && filter.maxLength < filter.minLength)
+	{
+		fprintf(stderr, "Orbit filter '%s' keeps no orbits.\n", filter.str().c_str());
+		*ok = false;
+		return;
+	}
+
+	for(size_t k = 0; k < targetSpecs.size(); ++k)
+		for(size_t j = 0; j < k; ++j)
+			if(targetSpecs[j].width == targetSpecs[k].width && targetSpecs[j].height == targetSpecs[k].height &&
+					abs((targetSpecs[j].complexWidth ? targetSpecs[j].complexWidth : cw) - (targetSpecs[k].complexWidth ? targetSpecs[k].complexWidth : cw)) <= 1e-9 &&
+					abs((targetSpecs[j].complexHeight ? targetSpecs[j].complexHeight : ch) - (targetSpecs[k].complexHeight ? targetSpecs[k].complexHeight : ch)) <= 1e-9 &&
+					targetSpecs[j].centerReal == targetSpecs[k].centerReal && targetSpecs[j].centerImag == targetSpecs[k].centerImag)
+			{
+				fprintf(stderr, "Target %dx%d is given twice.\n", targetSpecs[k].width, targetSpecs[k].height);
+				*ok = false;
+				return;
+			}
 
 	this->store = store;
 	this->storageElem = nullptr;
 
-	for (auto s : store->saves)
-	{
+	auto sameJob = [&](StorageElement *s, int w, int h, double cw, double ch, double re, double im) {
 		if (s->formula != formula)
-			continue;
+			return false;
 		if (s->width != w)
-			continue;
+			return false;
 		if (s->height != h)
-			continue;
+			return false;
 		if (s->steps != steps)
-			continue;
+			return false;
 		if (s->divergenceThreshold != div)
-			continue;
+			return false;
 		if (s->skipPoints != skip)
-			continue;
+			return false;
 		if (abs(s->complexHeight - ch) > 1e-9)
-			continue;
+			return false;
 		if (abs(s->complexWidth - cw) > 1e-9)
-			continue;
+			return false;
+		if (!s->centredAt(re, im))
+			return false;
+		if (s->shardIndex != shard || s->shardCount != shards)
+			return false;
+		if (s->profile != profile)
+			return false;
+		if (s->sampling != sampling)
+			return false;
+		if (s->filter != filter)
+			return false;
+		return true;
+	};
+
+	for (auto s : store->saves)
+	{
+		if (sameJob(s, w, h, cw, ch, 0, 0) && s->seededBy(0, 0, 0, 0))
+		{
+			this->storageElem = s;
+			break;
+		}
+	}
+
+	// a target holds the orbits of every step of its job, so it can only
+	// join the job before the first one
+	vector<StorageElement*> found(targetSpecs.size(), nullptr);
+	for(size_t k = 0; k < targetSpecs.size(); ++k)
+	{
+		auto &t = targetSpecs[k];
+		for (auto s : store->saves)
+			if (sameJob(s, t.width, t.height, t.complexWidth ? t.complexWidth : cw, t.complexHeight ? t.complexHeight : ch, t.centerReal, t.centerImag) && s->seededBy(w, h, cw, ch))
+				found[k] = s;
+		int at = found[k] ? found[k]->computedSteps : 0, expected = storageElem ? storageElem->computedSteps : 0;
+		if (at != expected)
+		{
+			fprintf(stderr, "Target %dx%d is at step %d, the job at step %d.\nTargets can only be added to a job that has not started.\n", t.width, t.height, at, expected);
+			*ok = false;
+			return;
+		}
+	}
 
+	if (!storageElem)
+	{
+		store->sync();
+		store->saves.push_back(new StorageElement());
+		StorageElement *s = store->saves.back();
 		this->storageElem = s;
-		return;
+
+		s->formula = formula;
+		s->uid = store->uidC++;
+		s->divergenceThreshold = div;
+		s->width = w;
+		s->height = h;
+		s->steps = steps;
+		s->skipPoints = skip;
+		s->computedSteps = 0;
+		s->complexWidth = cw;
+		s->complexHeight = ch;
+		s->shardIndex = shard;
+		s->shardCount = shards;
+		s->setProfile(profile);
+		s->sampling = sampling;
+		s->filter = filter;
+		s->headerSaved = false;
+
+		store->save();
+
+		createDivergencyTable(*s);
+
+		store->save();
+	}
+
+	// targets never seed orbits, so they need no divergence table
+	targets.push_back(storageElem);
+	merges.push_back(&mergeDat);
+	for(size_t k = 0; k < targetSpecs.size(); ++k)
+	{
+		if (!found[k])
+		{
+			store->sync();
+			store->saves.push_back(new StorageElement());
+			StorageElement *s = store->saves.back();
+			found[k] = s;
+
+			s->formula = formula;
+			s->uid = store->uidC++;
+			s->divergenceThreshold = div;
+			s->width = targetSpecs[k].width;
+			s->height = targetSpecs[k].height;
+			s->steps = steps;
+			s->skipPoints = skip;
+			s->computedSteps = 0;
+			s->complexWidth = targetSpecs[k].complexWidth ? targetSpecs[k].complexWidth : cw;
+			s->complexHeight = targetSpecs[k].complexHeight ? targetSpecs[k].complexHeight : ch;
+			s->centerReal = targetSpecs[k].centerReal;
+			s->centerImag = targetSpecs[k].centerImag;
+			s->shardIndex = shard;
+			s->shardCount = shards;
+			s->setProfile(profile);
+			s->sampling = sampling;
+			s->filter = filter;
+			s->seedWidth = w;
+			s->seedHeight = h;
+			s->seedComplexWidth = cw;
+			s->seedComplexHeight = ch;
+			s->headerSaved = false;
+
+			store->save();
+		}
+		targets.push_back(found[k]);
+		merges.push_back(new TileCache());
+	}
+}
+
+Calculator::~Calculator()
+{
+	for(size_t k = 1; k < merges.size(); ++k)
+		delete merges[k];
+}
+
+bool TargetSpec::parse(const string &spec)
+{
+	int n = 0, m = 0;
+	complexWidth = complexHeight = 0;
+	centerReal = centerImag = 0;
+	if(sscanf(spec.c_str(), "%dx%d%n", &width, &height, &n) != 2 || width <= 0 || height <= 0)
+		return false;
+	if(spec[n] == ':')
+	{
+		if(sscanf(spec.c_str() + n, ":%lfx%lf%n", &complexWidth, &complexHeight, &m) != 2 || !(complexWidth > 0) || !(complexHeight > 0))
+			return false;
+		n += m;
+	}
+	if(spec[n] == '@')
+	{
+		m = 0;
+		if(sscanf(spec.c_str() + n, "@%lf,%lf%n", &centerReal, &centerImag, &m) != 2)
+			return false;
+		n += m;
 	}
+	return !spec[n];
+}
+
+bool ConvergeOptions::parse(const string &option)
+{
+	double t;
+	int n = 0;
+	if(sscanf(option.c_str(), "converge=%lf%n", &t, &n) != 1 || !(t > 0))
+		return false;
+	if(option[n] && option.substr(n) != ":pause")
+		return false;
+	threshold = t;
+	pause = option[n];
+	return true;
+}
 
-	store->saves.push_back(new StorageElement());
-	StorageElement *s = store->saves.back();
-	this->storageElem = s;
+string TargetSpec::str() const
+{
+	char spec[128];
+	int n;
+	if(complexWidth)
+		n = snprintf(spec, sizeof(spec), "%dx%d:%gx%g", width, height, complexWidth, complexHeight);
+	else
+		n = snprintf(spec, sizeof(spec), "%dx%d", width, height);
+	if(centerReal || centerImag)
+		snprintf(spec + n, sizeof(spec) - n, "@%.17g,%.17g", centerReal, centerImag);
+	return spec;
+}
 
-	s->formula = formula;
-	s->uid = store->uidC++;
-	s->divergenceThreshold = div;
-	s->width = w;
-	s->height = h;
-	s->steps = steps;
-	s->skipPoints = skip;
-	s->computedSteps = 0;
-	s->complexWidth = cw;
-	s->complexHeight = ch;
-	s->headerSaved = false;
+static uint64_t splitmix(uint64_t z)
+{
+	z += 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// a 64 bit fixed point fraction as a double in [0, 1)
+static double unitFraction(uint64_t bits)
+{
+	return (bits >> 11) * (1. / (1ULL << 53));
+}
 
-	store->save();
+// Point i of the two dimensional Sobol sequence as fixed point fractions:
+// the bit-reversed index and the second dimension, whose direction numbers
+// come from the polynomial x + 1.
+static void sobolPoint(uint64_t i, uint64_t &u, uint64_t &v)
+{
+	u = v = 0;
+	for(uint64_t du = 1ULL << 63, dv = 1ULL << 63; i; i >>= 1, du >>= 1, dv ^= dv >> 1)
+	{
+		if(i & 1)
+		{
+			u ^= du;
+			v ^= dv;
+		}
+	}
+}
 
-	createDivergencyTable(*s);
+// Roberts' R2 sequence, stepped in fixed point so it stays exact at any
+// index.
+constexpr double PLASTIC = 1.32471795724474602596;
+static const uint64_t R2U = 1 / PLASTIC * 18446744073709551616.0, R2V = 1 / (PLASTIC * PLASTIC) * 18446744073709551616.0;
+
+// Writes the seeds of one stripe of a step to points, x and y interleaved.
+// Jittered stripes are the columns of the grid with every sample moved to a
+// random place in its cell, hashed from its position, so a stripe gives the
+// same seeds whenever it is computed. Sequence stripes are runs of 2^step
+// indices; step k starts at index (2^k - 1)^2 and takes as many seeds as
+// the grid adds in that step.
+static void samplePoints(const StorageElement &s, int step, uint64_t stripe, vector<double> &points)
+{
+	points.clear();
+	double halfW = s.complexWidth / 2, halfH = s.complexHeight / 2;
+	if(s.sampling == "jitter")
+	{
+		double xs = s.complexWidth * pow(0.5, step + 1), ys = s.complexHeight * pow(0.5, step + 1);
+		double xc = -halfW + xs * (stripe + 1), yStep = stripe % 2 ? ys * 2 : ys;
+		uint64_t column = splitmix(splitmix(step) ^ stripe), j = 0;
+		for(double yc = -halfH + ys; yc + yStep / 2 < halfH; yc += yStep, ++j)
+		{
+			uint64_t h = splitmix(column ^ j);
+			points.push_back(xc + (unitFraction(h) - 0.5) * xs);
+			points.push_back(yc + (unitFraction(splitmix(h)) - 0.5) * ys);
+		}
+		return;
+	}
+	uint64_t first = ((1ULL << step) - 1) * ((1ULL << step) - 1) + (stripe << step);
+	for(uint64_t i = first; i < first + (1ULL << step); ++i)
+	{
+		uint64_t u, v;
+		if(s.sampling == "sobol")
+			sobolPoint(i, u, v);
+		else
+		{
+			u = (1ULL << 63) + R2U * i;
+			v = (1ULL << 63) + R2V * i;
+		}
+		points.push_back(-halfW + unitFraction(u) * s.complexWidth);
+		points.push_back(-halfH + unitFraction(v) * s.complexHeight);
+	}
+}
 
-	store->save();
+// Stripes per step: the columns of the grid, or for the sequences the runs
+// of 2^step seeds that add up to as many seeds as the grid takes.
+uint64_t Calculator::stripeCount()
+{
+	if(storageElem->sampling == "grid" || storageElem->sampling == "jitter")
+		return (2UL << step) - 1;
+	return 3 * (1UL << step) - 2;
 }
 
 void Calculator::createDivergencyTable(StorageElement &s)
@@ -101,13 +433,25 @@ void Calculator::startCalculation()
 	ystep = storageElem->complexHeight*pow(0.5, storageElem->computedSteps+1);
 	y = -storageElem->complexHeight/2 + ystep;
 	stripe = 0;
+	step = storageElem->computedSteps;
+	stepPending = false;
 
 	threadData.resize(THREADCOUNT);
-	mergeDat.resize(storageElem->width * storageElem->height);
 
-	uint64_t stripeLoad = 0;
-	storageElem->loadPauseData(mergeDat, stripeLoad);
-	stripe = stripeLoad;
+	// the pause data of all targets was saved at the same stripe
+	double clipWidth = 0, clipHeight = 0;
+	for(size_t k = 0; k < targets.size(); ++k)
+	{
+		uint64_t stripeLoad = 0;
+		targets[k]->loadPauseData(*merges[k], stripeLoad);
+		if(!k)
+			stripe = stripeLoad;
+		else if(stripeLoad != stripe)
+			fprintf(stderr, "target %d was paused at stripe %lu, the job at %lu\n", targets[k]->uid, (unsigned long)stripeLoad, (unsigned long)stripe);
+		targets[k]->publishPending(merges[k], &merge);
+		clipWidth = max(clipWidth, (abs(targets[k]->centerReal) + targets[k]->complexWidth / 2) * (1 + 1e-9));
+		clipHeight = max(clipHeight, (abs(targets[k]->centerImag) + targets[k]->complexHeight / 2) * (1 + 1e-9));
+	}
 
 	calculating = THREADCOUNT;
 	waiting = merging = 0;
@@ -115,58 +459,95 @@ void Calculator::startCalculation()
 	{
 		threadData[i].next = 0;
 		threadData[i].cache.resize(CACHEPERTHREAD);
+		threadData[i].clipWidth = clipWidth;
+		threadData[i].clipHeight = clipHeight;
 		threadData[i].saveCallBack = [this, i](){
+			while(stepPending)
+				this_thread::sleep_for(1ms);
 			merge.lock();
-			int next = 0; 
-			double halfCompWidth = storageElem->complexWidth / 2;
-			double halfCompHeight = storageElem->complexHeight / 2;
-			double compScaleHori = storageElem->width / storageElem->complexWidth;
-			double compScaleVert = storageElem->height / storageElem->complexHeight;
-			while(next < threadData[i].next)
-			{
-				int kDiv = 0;
-				while(kDiv + next < threadData[i].next && get<2>(threadData[i].cache[kDiv + next]) == kDiv)
-					++kDiv;
-				complex<double> c = get<1>(threadData[i].cache[next]);	
-				int cx = (c.real() + halfCompWidth) * compScaleHori;
-				int cy = (c.imag() + halfCompHeight) * compScaleVert;
-				auto &cdat = mergeDat[cx + storageElem->width * cy];
-				cdat.startHits ++;
-				cdat.startSteps += kDiv;
-				for(int j = storageElem->skipPoints; j < kDiv; ++j)
-				{
-					complex<double> x;
-					int n;
-					tie(x,ignore,n) = threadData[i].cache[next+j];
-					int xx = floor((x.real() + halfCompWidth) * compScaleHori);
-					int xy = floor((x.imag() + halfCompHeight) * compScaleVert);
-
-					if(xx >= 0 && xy >= 0 && xx < storageElem->width && xy < storageElem->height)
-					{
-						auto &xdat = mergeDat[xx + storageElem->width * xy];
-						xdat.hits++;
-						xdat.realOrig += c.real();
-						xdat.imagOrig += c.imag();
-						xdat.steps += kDiv;
-						xdat.reachedStep += j;
-						if(j)
-						{
-							auto xlast = get<1>(threadData[i].cache[next+j-1]);
-							xdat.realLast += xlast.real();
-							xdat.imagLast += xlast.imag();
-						}
-					}
-				}
-				next += kDiv;
-			}
+			for(size_t k = 0; k < targets.size(); ++k)
+				accumulate(*targets[k], *merges[k], threadData[i]);
 			threadData[i].next = 0;
-
 			merge.unlock();
 		};
 		threads.emplace_back(&Calculator::worker, this, i);
 	}
 }
 
+// Adds the orbits a thread stored to the step dat holds for s.
+void Calculator::accumulate(StorageElement &s, TileCache &dat, ThreadData &td)
+{
+	int next = 0; 
+	double left = s.centerReal - s.complexWidth / 2;
+	double top = s.centerImag - s.complexHeight / 2;
+	double compScaleHori = s.width / s.complexWidth;
+	double compScaleVert = s.height / s.complexHeight;
+	auto &cache = td.cache;
+	bool starts = s.channels & channelBit(STARTHITS);
+
+	// bucket every contribution by its destination tile, so each tile
+	// only has to be paged in once per batch
+	pending.clear();
+	tileStart.assign(dat.tileCount() + 1, 0);
+	auto addContribution = [&](int px, int py, int entry, int kDiv, bool start){
+		if(px < 0 || py < 0 || px >= s.width || py >= s.height)
+			return;
+		int tile = dat.tileAt(px, py);
+		int x0, y0, w, h;
+		dat.tileRect(tile, x0, y0, w, h);
+		pending.push_back({tile, (px - x0) + (py - y0) * w, entry, kDiv, start});
+		tileStart[tile + 1]++;
+	};
+	// the kernels only stored the points inside the union of the windows
+	while(next < td.next)
+	{
+		int orbit = next, kDiv = -1 - get<2>(cache[orbit]);
+		complex<double> c = get<0>(cache[orbit]);
+		int cx = floor((c.real() - left) * compScaleHori);
+		int cy = floor((c.imag() - top) * compScaleVert);
+		if(starts)
+			addContribution(cx, cy, orbit, kDiv, true);
+		for(++next; next < td.next && get<2>(cache[next]) >= 0; ++next)
+		{
+			complex<double> x = get<0>(cache[next]);
+			int xx = floor((x.real() - left) * compScaleHori);
+			int xy = floor((x.imag() - top) * compScaleVert);
+			addContribution(xx, xy, next, kDiv, false);
+		}
+	}
+
+	for(int t = 0; t < dat.tileCount(); ++t)
+		tileStart[t + 1] += tileStart[t];
+	batched.resize(pending.size());
+	{
+		vector<int> cursor(tileStart.begin(), tileStart.end() - 1);
+		for(auto &p : pending)
+			batched[cursor[p.tile]++] = p;
+	}
+
+	for(int t = 0; t < dat.tileCount(); ++t)
+	{
+		if(tileStart[t] == tileStart[t + 1])
+			continue;
+		s.pendingVersion[t]++;
+		PixelColumns xdat = dat.pin(t, ALLCHANNELS, tileStart[t + 1] - tileStart[t]);
+		const Contribution *b = &batched[tileStart[t]], *e = b + (tileStart[t + 1] - tileStart[t]);
+		switch(s.channels)
+		{
+		case ALLCHANNELS:
+			applyTile<ALLCHANNELS>(xdat, b, e, cache);
+			break;
+		case ORIGINCHANNELS:
+			applyTile<ORIGINCHANNELS>(xdat, b, e, cache);
+			break;
+		case channelBit(HITS):
+			applyTile<channelBit(HITS)>(xdat, b, e, cache);
+			break;
+		}
+		dat.unpin(t, ALLCHANNELS);
+	}
+}
+
 void Calculator::stopCalculation()
 {
 	stop = true;
@@ -175,6 +556,13 @@ void Calculator::stopCalculation()
 		t.join();
 	threads.clear();
 	threadData.clear();
+	for(size_t k = 0; k < targets.size(); ++k)
+	{
+		targets[k]->publishPending(nullptr, nullptr);
+
+		// the step was paged to its own file; the pause data is still valid
+		merges[k]->discard();
+	}
 }
 
 void Calculator::pauseCalculation()
@@ -185,25 +573,146 @@ void Calculator::pauseCalculation()
 		t.join();
 	threads.clear();
 	threadData.clear();
+	// the last merged step has to be saved before the pause data of the
+	// next one is
+	store->sync();
+	for(size_t k = 0; k < targets.size(); ++k)
+	{
+		targets[k]->publishPending(nullptr, nullptr);
+		targets[k]->savePauseData(*merges[k], stripe);
+	}
+}
+
+// Reads the hits of the level the convergence metric looks at, row by row;
+// false if s has no pyramid to take it from.
+static bool levelHits(StorageElement &s, vector<uint64_t> &hits)
+{
+	int k = s.levelFor(CONVERGENCESIZE, CONVERGENCESIZE), w = s.levelWidth(k);
+	if(k && !s.pyramidLevels)
+		return false;
+	hits.assign((size_t)w * s.levelHeight(k), 0);
+	s.level(k).forEach(channelBit(HITS), [&](int x0, int y0, int tw, int th, PixelColumns &p){
+		for(int i = 0; i < tw * th; ++i)
+			hits[(x0 + i % tw) + (size_t)(y0 + i / tw) * w] = p.hits32 ? p.hits32[i] : p.hits[i];
+	});
+	return true;
+}
+
+// Mean change per hit pixel between the histogram-equalized images of two
+// versions of a level, where every pixel becomes the fraction of pixels
+// below it, ties counting half. Samples that only scale the image up
+// change nothing; pixels nothing reached yet do not count, or the empty
+// image of the first steps would look converged.
+static double equalizedChange(const vector<uint64_t> &before, const vector<uint64_t> &after)
+{
+	auto equalize = [](const vector<uint64_t> &v, vector<double> &e){
+		vector<uint64_t> sorted(v);
+		sort(sorted.begin(), sorted.end());
+		e.resize(v.size());
+		for(size_t i = 0; i < v.size(); ++i)
+		{
+			auto range = equal_range(sorted.begin(), sorted.end(), v[i]);
+			e[i] = ((range.first - sorted.begin()) + (range.second - sorted.begin())) / (2. * v.size());
+		}
+	};
+	vector<double> a, b;
+	equalize(before, a);
+	equalize(after, b);
+	double sum = 0;
+	size_t hit = 0;
+	for(size_t i = 0; i < a.size(); ++i)
+	{
+		if(!after[i])
+			continue;
+		sum += fabs(a[i] - b[i]);
+		++hit;
+	}
+	return hit ? sum / hit : 1;
+}
+
+// Adds the finished step dat holds to the data of s and its pyramid.
+void Calculator::mergeStep(StorageElement &s, TileCache &dat)
+{
+	s.rewriteData();
+	s.pyramidMtx.lock();
+	PixelBlock delta;
+	for(int t = 0; t < dat.tileCount(); ++t)
+	{
+		int x0, y0, w, h;
+		dat.tileRect(t, x0, y0, w, h);
+		PixelColumns d = s.data.pin(t, ALLCHANNELS);
+		PixelColumns td = dat.pin(t, ALLCHANNELS);
+		int n = w * h;
+
+		if(s.pyramidLevels)
+		{
+			dat.tileRect(t, delta.x0, delta.y0, delta.w, delta.h);
+			for(int c = 0; c < CHANNELCOUNT; ++c)
+			{
+				if(td.words[c])
+					delta.columns[c].assign(td.words[c], td.words[c] + n);
+				else
+					delta.columns[c].clear();
+			}
+			if(td.hits32)
+				delta.columns[HITS].assign(td.hits32, td.hits32 + n);
+		}
+
+		if(s.summaryValid)
+		{
+			if(td.hits32)
+				s.hitsSummary[0].addDelta(d.hits, td.hits32, n);
+			else
+				s.hitsSummary[0].addDelta(d.hits, td.hits, n);
+			s.summaryDirty = true;
+		}
+		if(td.hits32)
+			ISASELECT(mergeNarrow)(d.hits, td.hits32, n);
+		for(int c = 0; c < CHANNELCOUNT; ++c)
+		{
+			if(!td.words[c])
+				continue;
+			if(channelIsFloat(c))
+				ISASELECT(mergeFloats)(reinterpret_cast<double*>(d.words[c]), reinterpret_cast<double*>(td.words[c]), n);
+			else
+				ISASELECT(mergeWords)(d.words[c], td.words[c], n);
+		}
+
+		dat.unpin(t);
+		s.data.unpin(t, ALLCHANNELS);
 
-	storageElem->savePauseData(mergeDat, stripe);
+		if(s.pyramidLevels)
+			s.updatePyramid(delta);
+	}
+	s.pyramidMtx.unlock();
+	dat.discard();
+	s.deletePauseData();
 }
 
 void Calculator::worker(int threadNum)
 {
-	storageElem->aquireData();
+	for(auto t : targets)
+		t->aquireData();
 	storageElem->aquireDivergenceTable();
 	auto form = FormulaManager::formulas[storageElem->formula];
+	auto pointForm = FormulaManager::pointFormulas[storageElem->formula];
+	bool grid = storageElem->sampling == "grid";
+	vector<double> points;
 	while(!stop)
 	{
 		while(true)
 		{
 			calc.lock();
+			// a shard only computes every shardCount-th stripe of a step
+			while(stripe % storageElem->shardCount != (uint64_t)storageElem->shardIndex)
+				stripe++;
 			double myX = x + xstep * stripe;
 			double myY = y;
 			double myYstep = stripe % 2 ? ystep * 2 : ystep;
+			uint64_t myStripe = stripe;
+			int myStep = step;
 
-			if(myX + xstep/2 > storageElem->complexWidth/2)
+			if(grid ? myX + xstep/2 > storageElem->complexWidth/2 : stripe >= stripeCount())
 			{
 				calc.unlock();
 				break;
@@ -218,22 +727,35 @@ void Calculator::worker(int threadNum)
 
 				sync.lock();
 				storageElem->releaseDivergenceTable();
-				storageElem->releaseData();
+				for(auto t : targets)
+					t->releaseData();
 				sync.unlock();
 				return;
 			}
 			
 			stripe++;
+			bool takeFrame = recorder && recorder->options.every && stripe % recorder->options.every == 0;
+			for(auto t : targets)
+				t->pendingProgress = stripe / (double)stripeCount();
 			if(sync.try_lock())
 			{
-				printf("\033]0;%lu/%lu stripes\007", stripe, (2UL << storageElem->computedSteps)-1);
+				printf("\033]0;%lu/%lu stripes\007", stripe, stripeCount());
 				fflush(stdout);
 				sync.unlock();
 			}
 
 			calc.unlock();
 
-			form(myX, myY, myYstep, threadData[threadNum], *storageElem, &abort);
+			if(takeFrame)
+				recorder->capture(true);
+
+			if(grid)
+				form(myX, myY, myYstep, threadData[threadNum], *storageElem, &abort);
+			else
+			{
+				samplePoints(*storageElem, myStep, myStripe, points);
+				pointForm(points.data(), points.size() / 2, threadData[threadNum], *storageElem, &abort);
+			}
 		}
 
 		threadData[threadNum].saveCallBack();
@@ -258,19 +780,26 @@ void Calculator::worker(int threadNum)
 			{
 				calculating++;
 				storageElem->releaseDivergenceTable();
-				storageElem->releaseData();
+				for(auto t : targets)
+					t->releaseData();
 				sync.unlock();
 				return;
 			}
 		}
 		while(calculating);
 		waiting--;
-		merging++;
-		xstep = storageElem->complexWidth*pow(0.5, storageElem->computedSteps+2);
-		x = -storageElem->complexWidth/2 + xstep;
-		ystep = storageElem->complexHeight*pow(0.5, storageElem->computedSteps+2);
-		y = -storageElem->complexHeight/2 + ystep;
-		stripe = 0;
+		// the first thread out moves the stripes on to the next step; a fast
+		// thread may finish that one before computedSteps counts this one
+		if(!merging++)
+		{
+			stepPending = true;
+			step++;
+			xstep = storageElem->complexWidth*pow(0.5, step+1);
+			x = -storageElem->complexWidth/2 + xstep;
+			ystep = storageElem->complexHeight*pow(0.5, step+1);
+			y = -storageElem->complexHeight/2 + ystep;
+			stripe = 0;
+		}
 		sync.unlock();
 
 
@@ -285,42 +814,61 @@ void Calculator::worker(int threadNum)
 		calculating++;
 		if(!merging)
 		{
+			// the previous step must be on disk before its tiles change again
+			store->sync();
+			// the metric compares every target's image before and after
+			vector<vector<uint64_t>> before(targets.size());
+			vector<bool> measured(targets.size());
+			for(size_t k = 0; k < targets.size(); ++k)
+				measured[k] = targets[k]->computedSteps && levelHits(*targets[k], before[k]);
 			merge.lock();
-			for(int i = 0; i < storageElem->width; ++i)
+			for(size_t k = 0; k < targets.size(); ++k)
+				mergeStep(*targets[k], *merges[k]);
+			merge.unlock();
+			stepPending = false;
+
+			for(auto t : targets)
+			{
+				t->buildPyramid();
+				t->computedSteps++;
+				t->headerSaved = false;
+				t->dataDirty = true;
+			}
+
+			printf("Saving Step %d in background\n", storageElem->computedSteps);
+			for(size_t k = 0; k < targets.size(); ++k)
 			{
-				for(int j = 0; j < storageElem->height; ++j)
+				vector<uint64_t> after;
+				if(!measured[k] || !levelHits(*targets[k], after))
+					continue;
+				double change = equalizedChange(before[k], after);
+				targets[k]->convergence.emplace_back(targets[k]->computedSteps, change);
+				if(k)
+					continue;
+				printf("Step %d changed the equalized image by %.6f per pixel\n", storageElem->computedSteps, change);
+				if(converge.threshold && change < converge.threshold && !converged)
 				{
-					int index=i+j*storageElem->width;
-
-					auto &d = storageElem->data[index];
-					auto &td = mergeDat[index];
-
-					d.hits += td.hits; td.hits = 0;
-					d.realOrig += td.realOrig; td.realOrig = 0;
-					d.imagOrig += td.imagOrig; td.imagOrig = 0;
-					d.realLast += td.realLast; td.realLast = 0;
-					d.imagLast += td.imagLast; td.imagLast = 0;
-					d.steps += td.steps; td.steps = 0;
-					d.reachedStep += td.reachedStep; td.reachedStep = 0;
-					d.startHits += td.startHits; td.startHits = 0;
-					d.startSteps += td.startSteps; td.startSteps = 0;
+					printf("converged below %g, %s\n", converge.threshold, converge.pause ? "pausing" : "stopping");
+					converged = true;
+					abort = !converge.pause;
+					stop = true;
 				}
 			}
-
-			merge.unlock();
-
-			printf("Saving Step %d... ", ++storageElem->computedSteps);
-			storageElem->headerSaved = false;
-			storageElem->dataDirty = true;
-			storageElem->deletePauseData();
-			store->save();
-			printf("done\n");
 			fflush(stdout);
+			if(stopAfter && storageElem->computedSteps >= stopAfter)
+			{
+				abort = true;
+				stop = true;
+			}
+			if(recorder)
+				recorder->capture(false);
+			store->saveAsync();
 		}
 		sync.unlock();
 	}
 	sync.lock();
 	storageElem->releaseDivergenceTable();
-	storageElem->releaseData();
+	for(auto t : targets)
+		t->releaseData();
 	sync.unlock();
 }
@@ -10,27 +10,82 @@
 
 using namespace std;
 
+struct FrameRecorder;
+
+struct Contribution
+{
+	int tile, pixel;
+	int entry, kDiv;
+	bool start;
+};
+
+// A further dataset a job accumulates its orbits into; a window of 0 is
+// the job's own. The window can be centred anywhere, so a target can be a
+// zoomed crop of any region. Written as <w>x<h>[:<cw>x<ch>][@<re>,<im>].
+struct TargetSpec
+{
+	int width = 0, height = 0;
+	double complexWidth = 0, complexHeight = 0;
+	double centerReal = 0, centerImag = 0;
+
+	bool parse(const string &spec);
+	string str() const;
+};
+
+// Ends a job once a step changes its equalized hits image by less than
+// threshold per pixel, by stopping it or, with pause, pausing it. Written
+// as converge=<threshold>[:pause].
+struct ConvergeOptions
+{
+	double threshold = 0;
+	bool pause = false;
+
+	bool parse(const string &option);
+};
+
 struct Calculator
 {
 
 	StorageElement *storageElem;
 	Storage* store;
+	// every dataset the orbits go to, storageElem first, which seeds them,
+	// and the step each of them has pending; all advance in lockstep
+	vector<StorageElement*> targets;
+	vector<TileCache*> merges;
 
 	vector<ThreadData> threadData;
 	vector<thread> threads;
-	vector<PixelData> mergeDat;
+	TileCache mergeDat;
+	vector<Contribution> pending, batched;
+	vector<int> tileStart;
 	mutex sync, merge, calc;
 	volatile int calculating = 0, waiting = 0, merging = 0;
+	// from the end of a step until it is merged; flushes wait for it, so the
+	// next step's samples never end up in the merged one
+	volatile bool stepPending = false;
 	volatile bool stop = false, abort = false;
 	volatile double x, y, xstep, ystep;
 	volatile uint64_t stripe;
+	// the step the stripes handed out belong to
+	volatile int step;
+	// takes time-lapse frames of the calculation if set
+	FrameRecorder *recorder = nullptr;
+	// stops the workers once this many steps are computed
+	int stopAfter = 0;
+	ConvergeOptions converge;
+	// set once the job met converge; it still has to be stopped or paused
+	volatile bool converged = false;
 
-	Calculator(char *formula, int w, int h, int steps, int div, int skip, double cw, double ch, bool *ok, Storage *store);
+	Calculator(char *formula, int w, int h, int steps, int div, int skip, double cw, double ch, int shard, int shards, const char *profile, const char *sampling, const OrbitFilter &filter, const vector<TargetSpec> &targetSpecs, bool *ok, Storage *store);
+	~Calculator();
 	void createDivergencyTable(StorageElement &s);
+	void accumulate(StorageElement &s, TileCache &dat, ThreadData &td);
+	void mergeStep(StorageElement &s, TileCache &dat);
 	void startCalculation();
 	void stopCalculation();
 	void pauseCalculation();
 	void worker(int threadNum);
+	uint64_t stripeCount();
 };
 
 #endif
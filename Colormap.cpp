@@ -0,0 +1,210 @@
+#include "Colormap.h"
+#include "Isa.h"
+
+#include <cstdio>
+#include <cmath>
+#include <tuple>
+#include <algorithm>
+
+void hslToRGB(double h, double s, double l, double &r, double &g, double &b) {
+	double c = (1-abs(2*l-1))*s;
+	double hs = h * 6;
+	double x = c * (1-abs(fmod(hs, 2)-1));
+
+	r = g = b = 0;
+	switch((int)hs)
+	{
+		case 0: tie(r,g,b) = make_tuple(c,x,0); break;
+		case 1: tie(r,g,b) = make_tuple(x,c,0); break;
+		case 2: tie(r,g,b) = make_tuple(0,c,x); break;
+		case 3: tie(r,g,b) = make_tuple(0,x,c); break;
+		case 4: tie(r,g,b) = make_tuple(x,0,c); break;
+		case 5: tie(r,g,b) = make_tuple(c,0,x); break;
+	}
+
+	double m = l - 0.5 * c;
+	r = max(0., min(1., r+m));
+	g = max(0., min(1., g+m));
+	b = max(0., min(1., b+m));
+}
+
+// Reads a gradient, one stop per line: a position between 0 and 1 and the
+// red, green and blue of it from 0 to 255. Lines starting with # are
+// comments. Stops come out as position, r, g, b with colours scaled to 1.
+bool Colormap::loadPalette(const string &filename, vector<float> &stops)
+{
+	FILE *fp = fopen(filename.c_str(), "r");
+	if(!fp)
+	{
+		fprintf(stderr, "could not open palette '%s'\n", filename.c_str());
+		return false;
+	}
+	stops.clear();
+	char line[512];
+	int lineNumber = 0;
+	bool ok = true;
+	while(ok && fgets(line, sizeof(line), fp))
+	{
+		++lineNumber;
+		char first = 0;
+		if(sscanf(line, " %c", &first) != 1 || first == '#')
+			continue;
+		float pos, r, g, b;
+		if(sscanf(line, "%f %f %f %f", &pos, &r, &g, &b) != 4 || pos < 0 || pos > 1 || (stops.size() && pos < stops[stops.size() - 4]))
+		{
+			fprintf(stderr, "%s:%d: expected '<position> <r> <g> <b>' with ascending positions from 0 to 1\n", filename.c_str(), lineNumber);
+			ok = false;
+			break;
+		}
+		stops.insert(stops.end(), {pos, r / 255, g / 255, b / 255});
+	}
+	fclose(fp);
+	if(ok && stops.size() < 8)
+	{
+		fprintf(stderr, "palette '%s' needs at least two stops\n", filename.c_str());
+		ok = false;
+	}
+	return ok;
+}
+
+static void gradient(const vector<float> &stops, double p, double &r, double &g, double &b)
+{
+	size_t i = 0;
+	while(i + 4 < stops.size() && stops[i + 4] <= p)
+		i += 4;
+	double w = 0;
+	if(i + 4 < stops.size() && p > stops[i])
+		w = (p - stops[i]) / (stops[i + 4] - stops[i]);
+	size_t j = i + 4 < stops.size() ? i + 4 : i;
+	r = stops[i + 1] + (stops[j + 1] - stops[i + 1]) * w;
+	g = stops[i + 2] + (stops[j + 2] - stops[i + 2]) * w;
+	b = stops[i + 3] + (stops[j + 3] - stops[i + 3]) * w;
+}
+
+// Samples the curves for a render type. Without a palette file hits are
+// shades of green and the hue modes use the HSL colour wheel; origin
+// colours its channels directly and takes no palette.
+bool Colormap::build(const string &type, const string &paletteFile)
+{
+	Mode m = type == "origin" ? CHANNELS : type == "direction" ? HUELIGHTNESS : SCALAR;
+	double gamma = type == "fractal" ? 1 : 10;
+	vector<float> stops;
+	if(!paletteFile.empty())
+	{
+		if(m == CHANNELS)
+		{
+			fprintf(stderr, "render type '%s' colours its channels directly and takes no palette\n", type.c_str());
+			return false;
+		}
+		if(!loadPalette(paletteFile, stops))
+			return false;
+	}
+
+	curve.resize(SIZE + 1);
+	palette.resize((SIZE + 1) * 3);
+	for(int i = 0; i <= SIZE; ++i)
+	{
+		double x = min(1., i / (double)(SIZE - 1));
+		curve[i] = pow(x, gamma);
+		double p = m == SCALAR ? curve[i] : x;
+		double r, g, b;
+		if(stops.size())
+			gradient(stops, p, r, g, b);
+		else if(type == "hits")
+			tie(r, g, b) = make_tuple(0., p, 0.);
+		else
+			hslToRGB(min(p, 0.999999999), 1, 0.5, r, g, b);
+		palette[i * 3] = r;
+		palette[i * 3 + 1] = g;
+		palette[i * 3 + 2] = b;
+	}
+	mode = m;
+	components = m == CHANNELS ? 3 : m == HUELIGHTNESS ? 2 : 1;
+	return true;
+}
+
+// Linear interpolation between the samples; NaN ends up at 0.
+static inline float lookup(const float *table, float x, int stride = 1)
+{
+	x = x > 0 ? (x < 1 ? x : 1) : 0;
+	float f = x * (Colormap::SIZE - 1);
+	int i = (int)f;
+	float w = f - i;
+	return table[i * stride] + (table[(i + 1) * stride] - table[i * stride]) * w;
+}
+
+static inline void mapScalar(const float *palette, float v, float *rgb)
+{
+	for(int c = 0; c < 3; ++c)
+		rgb[c] = v < 0 ? 0 : lookup(palette + c, v, 3);
+}
+
+// HSL with full saturation, with the palette in place of the pure hues.
+static inline void mapHueLightness(const float *curve, const float *palette, const float *v, float *rgb)
+{
+	float l = lookup(curve, v[1]);
+	float chroma = 1 - fabs(2 * l - 1);
+	float m = l - chroma / 2;
+	for(int c = 0; c < 3; ++c)
+		rgb[c] = m + chroma * lookup(palette + c, v[0], 3);
+}
+
+static inline void mapChannels(const float *curve, const float *v, float *rgb)
+{
+	for(int c = 0; c < 3; ++c)
+		rgb[c] = lookup(curve, v[c]);
+}
+
+void Colormap::map(const float *v, float *rgb) const
+{
+	if(mode == SCALAR)
+		mapScalar(palette.data(), v[0], rgb);
+	else if(mode == HUELIGHTNESS)
+		mapHueLightness(curve.data(), palette.data(), v, rgb);
+	else
+		mapChannels(curve.data(), v, rgb);
+}
+
+// One pass over n pixels of values; field, if given, gets the colours
+// unquantized. The mode is decided outside the loops so each one stays a
+// straight run of table lookups the compiler can unroll and vectorize.
+static ISAINLINE void applyPixels(Colormap::Mode mode, const float *c, const float *p, const float *values, size_t n, uint32_t *pixels, float *field)
+{
+	float rgb[3];
+	if(mode == Colormap::SCALAR)
+	{
+		for(size_t i = 0; i < n; ++i)
+		{
+			mapScalar(p, values[i], rgb);
+			pixels[i] = Colormap::argb(rgb[0], rgb[1], rgb[2]);
+			if(field)
+				copy(rgb, rgb + 3, field + i * 3);
+		}
+	}
+	else if(mode == Colormap::HUELIGHTNESS)
+	{
+		for(size_t i = 0; i < n; ++i)
+		{
+			mapHueLightness(c, p, values + i * 2, rgb);
+			pixels[i] = Colormap::argb(rgb[0], rgb[1], rgb[2]);
+			if(field)
+				copy(rgb, rgb + 3, field + i * 3);
+		}
+	}
+	else
+	{
+		for(size_t i = 0; i < n; ++i)
+		{
+			mapChannels(c, values + i * 3, rgb);
+			pixels[i] = Colormap::argb(rgb[0], rgb[1], rgb[2]);
+			if(field)
+				copy(rgb, rgb + 3, field + i * 3);
+		}
+	}
+}
+ISAVARIANTS(void, applyPixels, (Colormap::Mode mode, const float *c, const float *p, const float *values, size_t n, uint32_t *pixels, float *field), (mode, c, p, values, n, pixels, field))
+
+void Colormap::apply(const float *values, size_t n, uint32_t *pixels, float *field) const
+{
+	ISASELECT(applyPixels)(mode, curve.data(), palette.data(), values, n, pixels, field);
+}
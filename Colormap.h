@@ -0,0 +1,47 @@
+#ifndef _COLORMAP_H_
+#define _COLORMAP_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+void hslToRGB(double h, double s, double l, double &r, double &g, double &b);
+
+// Turns the normalized values a render mode produces into colours. The
+// curves are sampled into tables once, so a pixel costs a few lookups
+// instead of pow and the HSL conversion.
+//
+// SCALAR modes (hits, fractal) produce one value per pixel, looked up in a
+// palette that already has the gamma curve applied. HUELIGHTNESS (direction)
+// produces a hue and a lightness, CHANNELS (origin) one value per colour
+// channel. Negative values mark pixels without data, which stay black.
+struct Colormap
+{
+	static const int SIZE = 4096;
+
+	enum Mode
+	{
+		SCALAR, HUELIGHTNESS, CHANNELS
+	};
+
+	Mode mode = SCALAR;
+	int components = 0;
+	// SIZE + 1 samples each, the last one only read when interpolating at 1
+	vector<float> curve, palette;
+
+	bool empty() const { return !components; }
+	bool build(const string &type, const string &paletteFile = "");
+	static bool loadPalette(const string &filename, vector<float> &stops);
+
+	void map(const float *v, float *rgb) const;
+	void apply(const float *values, size_t n, uint32_t *pixels, float *field) const;
+
+	static uint32_t argb(float r, float g, float b)
+	{
+		return 0xFF000000 | ((int)(r * 255) << 16) | ((int)(g * 255) << 8) | ((int)(b * 255));
+	}
+};
+
+#endif
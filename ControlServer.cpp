@@ -0,0 +1,306 @@
+#include "ControlServer.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+
+#include <SDL2/SDL_endian.h>
+
+static bool sendAll(int fd, const void *data, size_t n)
+{
+	auto p = static_cast<const char*>(data);
+	while(n)
+	{
+		ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			return false;
+		p += sent;
+		n -= sent;
+	}
+	return true;
+}
+
+static bool reply(int fd, const string &line)
+{
+	return sendAll(fd, (line + "\n").c_str(), line.size() + 1);
+}
+
+ControlServer::~ControlServer()
+{
+	if(listenFd < 0)
+		return;
+	close(listenFd);
+	unlink(path.c_str());
+}
+
+bool ControlServer::open(const string &socketPath)
+{
+	path = socketPath;
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if(path.size() >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "socket path '%s' is too long\n", path.c_str());
+		return false;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path.c_str());
+	if(listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) || listen(listenFd, 8))
+	{
+		fprintf(stderr, "could not listen on '%s': %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	mkdir("storage", 0777);
+	mkdir(cacheDir.c_str(), 0777);
+	printf("listening on '%s'\n", path.c_str());
+	fflush(stdout);
+	return true;
+}
+
+// Waits up to IDLEINTERVAL for fd to become readable; false after running
+// idle instead.
+bool ControlServer::wait(int fd)
+{
+	pollfd p = {fd, POLLIN, 0};
+	if(poll(&p, 1, IDLEINTERVAL) != 0)
+		return true;
+	if(idle)
+		idle();
+	return false;
+}
+
+void ControlServer::run()
+{
+	while(!quit)
+	{
+		if(!wait(listenFd))
+			continue;
+		int fd = accept(listenFd, nullptr, nullptr);
+		if(fd < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "accept failed: %s\n", strerror(errno));
+			break;
+		}
+		serve(fd);
+		close(fd);
+	}
+}
+
+void ControlServer::serve(int fd)
+{
+	string buffer;
+	char chunk[4096];
+	while(!quit)
+	{
+		auto eol = buffer.find('\n');
+		if(eol == string::npos)
+		{
+			if(!wait(fd))
+				continue;
+			ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+			if(got < 0 && errno == EINTR)
+				continue;
+			if(got <= 0)
+				return;
+			buffer.append(chunk, got);
+			continue;
+		}
+		string request = buffer.substr(0, eol);
+		buffer.erase(0, eol + 1);
+		if(request.size() && request.back() == '\r')
+			request.pop_back();
+		bool ok = handle(fd, request);
+		fflush(stdout);
+		if(!ok)
+			return;
+	}
+}
+
+// False if the client is gone.
+bool ControlServer::handle(int fd, const string &request)
+{
+	string cmd = request.substr(0, request.find(' '));
+	if(cmd.empty())
+		return true;
+
+	if(cmd == "progress")
+	{
+		for(auto s : store->saves)
+		{
+			lock_guard<mutex> lock(s->liveMtx);
+			if(!s->pending)
+				continue;
+			char line[256];
+			snprintf(line, sizeof(line), "ok running %d step %d progress %.4f", s->uid, s->computedSteps, (double)s->pendingProgress);
+			return reply(fd, line);
+		}
+		return reply(fd, "ok idle");
+	}
+	if(cmd == "list")
+	{
+		string out = "ok " + to_string(store->saves.size()) + "\n";
+		for(auto s : store->saves)
+		{
+			char line[1024];
+			snprintf(line, sizeof(line), "%d %s %dx%d %d %d %d %.17g %.17g %d/%d %s %d %s %d %d %d %d %d %.17g %.17g %.17g %.17g\n",
+					s->uid, s->formula.c_str(), s->width, s->height, s->steps, s->divergenceThreshold,
+					s->skipPoints, s->complexWidth, s->complexHeight, s->shardIndex, s->shardCount,
+					s->profile.c_str(), s->computedSteps, s->sampling.c_str(), s->filter.minLength, s->filter.maxLength, s->filter.thin,
+					s->seedWidth, s->seedHeight, s->seedComplexWidth, s->seedComplexHeight, s->centerReal, s->centerImag);
+			out += line;
+		}
+		return sendAll(fd, out.data(), out.size());
+	}
+	if(cmd == "render")
+		return sendRender(fd, request);
+	if(cmd == "channel")
+		return sendChannel(fd, request);
+	if(cmd == "quit")
+	{
+		bool running = false;
+		for(auto s : store->saves)
+			running |= s->pending != nullptr;
+		if(running)
+			execute("pause");
+		quit = true;
+		return reply(fd, "ok");
+	}
+	if(cmd == "view")
+		return reply(fd, "error view needs a display");
+	if(cmd == "calc" || cmd == "select" || cmd == "queue" || cmd == "pause" || cmd == "stop" || cmd == "sync" || cmd == "merge" || cmd == "save" || cmd == "renderall")
+		return reply(fd, execute(request) ? "ok" : "error " + cmd + " failed, see the daemon log");
+	return reply(fd, "error unknown request '" + cmd + "'");
+}
+
+StorageElement *ControlServer::find(int uid)
+{
+	for(auto s : store->saves)
+		if(s->uid == uid)
+			return s;
+	return nullptr;
+}
+
+// Every request renders to its own file in cacheDir, which the render
+// cache keeps until the dataset finishes another step.
+bool ControlServer::sendRender(int fd, const string &request)
+{
+	int uid = -1, maxW = 0, maxH = 0, n = 0;
+	char renderType[512] = "", rest[512] = "", option[512];
+	if(sscanf(request.c_str(), "render %d %511s %511[^\n]", &uid, renderType, rest) < 2)
+		return reply(fd, "error expected 'render <uid> <type> [<w>x<h>] [<options>]'");
+	auto s = find(uid);
+	if(!s)
+		return reply(fd, "error no dataset " + to_string(uid));
+	if(sscanf(rest, "%dx%d%n", &maxW, &maxH, &n) == 2)
+		memmove(rest, rest + n, strlen(rest + n) + 1);
+	else
+		maxW = maxH = 0;
+	ViewWindow vw(s, renderType, maxW, maxH);
+	while(sscanf(rest, " %511s%n", option, &n) == 1)
+	{
+		if(!vw.exportOptions.parse(option))
+			return reply(fd, string("error unknown export option '") + option + "'");
+		memmove(rest, rest + n, strlen(rest + n) + 1);
+	}
+	if(!ViewWindow::checkChannels(s, renderType))
+		return reply(fd, string("error dataset does not store the channels of '") + renderType + "'");
+
+	// the file is named after the key without the step, FNV-1a hashed
+	string key = vw.cacheKey();
+	string name = to_string(uid) + key.substr(key.find(" type="));
+	uint64_t hash = 14695981039346656037ULL;
+	for(char ch : name)
+		hash = (hash ^ (uint8_t)ch) * 1099511628211ULL;
+	char filename[1024];
+	snprintf(filename, sizeof(filename), "%s/render_%016llx.png", cacheDir.c_str(), (unsigned long long)hash);
+
+	if(cache->lookup(filename, key))
+		printf("serving cached render of dataset %d\n", uid);
+	else
+	{
+		string partial = filename + ".part.png"s;
+		if(!vw.setColormap() || !vw.createToFile(partial) || rename(partial.c_str(), filename))
+			return reply(fd, "error render failed, see the daemon log");
+		cache->record(filename, key);
+		cache->save();
+	}
+
+	struct stat st;
+	FILE *fp = fopen(filename, "rb");
+	if(!fp)
+		return reply(fd, "error could not read the render");
+	fstat(fileno(fp), &st);
+	if(!reply(fd, "ok " + to_string((long long)st.st_size)))
+	{
+		fclose(fp);
+		return false;
+	}
+	vector<char> buffer(1 << 20);
+	size_t got;
+	bool ok = true;
+	while(ok && (got = fread(buffer.data(), 1, buffer.size(), fp)) > 0)
+		ok = sendAll(fd, buffer.data(), got);
+	fclose(fp);
+	return ok;
+}
+
+// Streams one tile row at a time, so only the tiles of that row are pinned.
+bool ControlServer::sendChannel(int fd, const string &request)
+{
+	int uid = -1, level = 0;
+	char name[512] = "";
+	if(sscanf(request.c_str(), "channel %d %511s %d", &uid, name, &level) < 2)
+		return reply(fd, "error expected 'channel <uid> <channel> [<level>]'");
+	auto s = find(uid);
+	if(!s)
+		return reply(fd, "error no dataset " + to_string(uid));
+	int c = 0;
+	while(c < CHANNELCOUNT && strcmp(channelNames[c], name))
+		++c;
+	if(c == CHANNELCOUNT || !(s->channels & (1u << c)))
+		return reply(fd, string("error dataset does not store a channel '") + name + "'");
+	if(level < 0 || level > s->pyramidDepth())
+		return reply(fd, "error dataset has levels 0 to " + to_string(s->pyramidDepth()));
+
+	s->aquireData();
+	if(level)
+		s->buildPyramid();
+	auto &cache = s->level(level);
+	int width = s->levelWidth(level), height = s->levelHeight(level);
+	bool ok = reply(fd, "ok " + to_string(width) + " " + to_string(height) + " " + to_string((long long)width * height * sizeof(uint64_t)));
+	vector<uint64_t> row(width);
+	vector<PixelColumns> cols(cache.tilesX);
+	for(int ty = 0; ok && ty < cache.tilesY; ++ty)
+	{
+		for(int tx = 0; tx < cache.tilesX; ++tx)
+			cols[tx] = cache.pin(tx + ty * cache.tilesX, 1u << c);
+		int rows = min(TILESIZE, height - ty * TILESIZE);
+		for(int y = 0; ok && y < rows; ++y)
+		{
+			for(int tx = 0; tx < cache.tilesX; ++tx)
+			{
+				int x0 = tx * TILESIZE, w = min(TILESIZE, width - x0);
+				for(int x = 0; x < w; ++x)
+				{
+					uint64_t v = cols[tx].hits32 ? cols[tx].hits32[x + y * w] : cols[tx].words[c][x + y * w];
+					row[x0 + x] = SDL_SwapBE64(v);
+				}
+			}
+			ok = sendAll(fd, row.data(), row.size() * sizeof(uint64_t));
+		}
+		for(int tx = 0; tx < cache.tilesX; ++tx)
+			cache.unpin(tx + ty * cache.tilesX);
+	}
+	s->releaseData();
+	return ok;
+}
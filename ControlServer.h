@@ -0,0 +1,54 @@
+#ifndef _CONTROLSERVER_H_
+#define _CONTROLSERVER_H_
+
+#include <string>
+#include <functional>
+
+#include "Storage.h"
+#include "RenderManager.h"
+
+using namespace std;
+
+// The daemon mode: takes requests on a Unix domain socket, one line each,
+// and answers with a line starting with "ok" or "error <message>". Job
+// commands (calc, select, queue, pause, stop, sync, merge) are the REPL's
+// and run through execute; the server adds
+//
+//   progress                        the running job, or idle
+//   list                            "ok <n>" and one line per dataset
+//   render <uid> <type> [<w>x<h>] [<save options>]
+//                                   "ok <bytes>" and the PNG
+//   channel <uid> <channel> [<level>]
+//                                   "ok <w> <h> <bytes>" and the channel,
+//                                   row by row in big-endian 64 bit words
+//   quit                            pauses the job and ends the daemon
+//
+// A connection can send any number of requests; they are served one at a
+// time, payloads streamed as they are produced or read. While no request
+// comes in, idle runs every IDLEINTERVAL milliseconds.
+struct ControlServer
+{
+	static constexpr int IDLEINTERVAL = 200;
+
+	Storage *store = 0;
+	function<bool(const string&)> execute;
+	function<void()> idle;
+	RenderCache *cache = 0;
+	string path, cacheDir = "storage/renders";
+	int listenFd = -1;
+	bool quit = false;
+
+	~ControlServer();
+
+	bool open(const string &socketPath);
+	void run();
+	bool wait(int fd);
+	void serve(int fd);
+	bool handle(int fd, const string &request);
+
+	StorageElement *find(int uid);
+	bool sendRender(int fd, const string &request);
+	bool sendChannel(int fd, const string &request);
+};
+
+#endif
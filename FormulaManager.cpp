@@ -1,49 +1,117 @@
 #include "FormulaManager.h"
+#include "Isa.h"
 
 #include <complex>
 
 using namespace std;
 
 map<string, function<void(double, double, double, ThreadData&, const StorageElement&, volatile bool*)>> FormulaManager::formulas;
+map<string, function<void(const double*, int, ThreadData&, const StorageElement&, volatile bool*)>> FormulaManager::pointFormulas;
 map<string, function<bool(double, double, const StorageElement&)>> FormulaManager::diverges;
 
 #define INDEX(x, y) ((xi = int(x)) + settings.width * (yi = int(y)))
-#define INDEXCOMP(x, y) INDEX((x + halfCompWidth) * compScaleHori, (y + halfCompHeight) * compScaleVert) 
+#define INDEXCOMP(x, y) INDEX((x + p.halfCompWidth) * p.compScaleHori, (y + p.halfCompHeight) * p.compScaleVert) 
+
+// The settings an orbit is filtered by, read once per column or point list
+// rather than through settings inside the iteration loop.
+struct OrbitBounds
+{
+	double halfCompWidth, halfCompHeight;
+	double compScaleHori, compScaleVert;
+	double clipWidth, clipHeight;
+	double thres;
+	int skip, thin;
+	int minLength, maxLength;
+	bool starts;
+
+	OrbitBounds(const StorageElement &settings, const ThreadData &data)
+	{
+		halfCompWidth = settings.complexWidth / 2;
+		halfCompHeight = settings.complexHeight / 2;
+		compScaleHori = settings.width / settings.complexWidth;
+		compScaleVert = settings.height / settings.complexHeight;
+		clipWidth = data.clipWidth;
+		clipHeight = data.clipHeight;
+		thres = settings.divergenceThreshold * (double)settings.divergenceThreshold;
+		skip = settings.skipPoints;
+		thin = settings.filter.thin;
+		minLength = max(1, settings.filter.minLength);
+		maxLength = settings.filter.maxLength ? settings.filter.maxLength : settings.steps;
+		starts = settings.channels & channelBit(STARTHITS);
+	}
+};
 
 void FormulaManager::init()
 {
-#define FORMULA(f) formulas[#f] = [](double xc, double ystart, double ystep, ThreadData& data, const StorageElement& settings, volatile bool *stop){ \
-	double halfCompWidth = settings.complexWidth / 2; \
-	double halfCompHeight = settings.complexHeight / 2; \
-	double compScaleHori = settings.width / settings.complexWidth; \
-	double compScaleVert = settings.height / settings.complexHeight; \
-	double thres = settings.divergenceThreshold * (double)settings.divergenceThreshold;\
-	int xi, yi;\
-	\
-	for (double yc = ystart; yc + ystep/2 < halfCompHeight && !*stop; yc += ystep) \
+// Each formula's kernels are a local struct, so their variants for the
+// instruction sets can be generated from one body. iterate walks a column
+// of the refinement grid, iteratePoints a list of seeds. orbit stores the
+// points that pass the job's filter behind the orbit's header and drops the
+// orbit again if its length is outside the filter's band or nothing of it
+// would be accumulated.
+#define FORMULA(f) { struct Kernel { \
+	static ISAINLINE void orbit(complex<double> c, const OrbitBounds &p, ThreadData& data, const StorageElement& settings) \
 	{ \
-		complex<double> c(xc, yc), x; \
-		\
-		int startindex = INDEXCOMP(xc, yc); \
-		\
-		if (!settings.divergenceTable[startindex]) \
-			continue; \
-		\
+		complex<double> x; \
 		int kDiv = 0; \
 		if(data.next + settings.steps >= data.cache.size()) \
 			data.saveCallBack();\
+		int kept = data.next + 1, keep = p.skip; \
 		for (; kDiv < settings.steps; ++kDiv) \
 		{ \
 			f; \
-			data.cache[kDiv+data.next] = make_tuple(x,c,kDiv); \
-			if (x.imag() * x.imag() + x.real() * x.real() > thres) \
+			data.cache[kept] = make_tuple(x,c,kDiv); \
+			if (x.imag() * x.imag() + x.real() * x.real() > p.thres) \
 				break; \
+			if (kDiv == keep) \
+			{ \
+				kept += fabs(x.real()) <= p.clipWidth && fabs(x.imag()) <= p.clipHeight; \
+				keep += p.thin; \
+			} \
 		} \
 		\
-		if (kDiv != settings.steps) \
-			data.next += kDiv;\
+		if (kDiv != settings.steps && kDiv >= p.minLength && kDiv <= p.maxLength && (p.starts || kept > data.next + 1)) \
+		{ \
+			data.cache[data.next] = make_tuple(c,complex<double>(),-1-kDiv); \
+			data.next = kept;\
+		} \
+	} \
+	static ISAINLINE void iterate(double xc, double ystart, double ystep, ThreadData& data, const StorageElement& settings, volatile bool *stop) \
+	{ \
+		OrbitBounds p(settings, data); \
+		int xi, yi;\
+		\
+		for (double yc = ystart; yc + ystep/2 < p.halfCompHeight && !*stop; yc += ystep) \
+		{ \
+			int startindex = INDEXCOMP(xc, yc); \
+			\
+			if (!settings.divergenceTable[startindex]) \
+				continue; \
+			\
+			orbit(complex<double>(xc, yc), p, data, settings); \
+		} \
+	} \
+	static ISAINLINE void iteratePoints(const double *points, int n, ThreadData& data, const StorageElement& settings, volatile bool *stop) \
+	{ \
+		OrbitBounds p(settings, data); \
+		int xi, yi;\
+		\
+		for (int i = 0; i < n && !*stop; ++i) \
+		{ \
+			double xc = points[i * 2], yc = points[i * 2 + 1]; \
+			int startindex = INDEXCOMP(xc, yc); \
+			\
+			if (xi >= settings.width || yi >= settings.height || !settings.divergenceTable[startindex]) \
+				continue; \
+			\
+			orbit(complex<double>(xc, yc), p, data, settings); \
+		} \
 	} \
-};\
+	ISAVARIANTS(void, iterate, (double xc, double ystart, double ystep, ThreadData& data, const StorageElement& settings, volatile bool *stop), (xc, ystart, ystep, data, settings, stop)) \
+	ISAVARIANTS(void, iteratePoints, (const double *points, int n, ThreadData& data, const StorageElement& settings, volatile bool *stop), (points, n, data, settings, stop)) \
+}; \
+formulas[#f] = ISASELECT(Kernel::iterate); \
+pointFormulas[#f] = ISASELECT(Kernel::iteratePoints); } \
 diverges[#f] = [](double x1, double x2, const StorageElement& settings){\
 	complex<double> x, c(x1,x2);\
 	for(int i = 0; i < 100; ++i)\
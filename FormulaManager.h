@@ -12,6 +12,8 @@ using namespace std;
 struct FormulaManager
 {
 	static map<string, function<void(double, double, double, ThreadData&, const StorageElement&, volatile bool*)>> formulas;
+	// the same kernels on a list of seeds, x and y interleaved
+	static map<string, function<void(const double*, int, ThreadData&, const StorageElement&, volatile bool*)>> pointFormulas;
 	static map<string, function<bool(double, double, const StorageElement&)>> diverges;
 	static void init();
 };
@@ -0,0 +1,380 @@
+#include "Golden.h"
+#include "Calculator.h"
+#include "RenderManager.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std::chrono;
+
+constexpr int GOLDENWIDTH = 200, GOLDENHEIGHT = 150;
+constexpr int GOLDENITERATIONS = 200, GOLDENDIVERGENCE = 50;
+constexpr int GOLDENSTEPS = 8;
+constexpr double FLOATTOLERANCE = 1e-9;
+constexpr double PERFSLACK = 1.5;
+// seconds any run may take longer without counting as slower
+constexpr double PERFNOISE = 0.1;
+constexpr int PERFRUNS = 5;
+constexpr int PERFHISTORY = 20;
+// times a slow timing is measured again before it fails
+constexpr int PERFRETRIES = 2;
+constexpr uint32_t FLOATCHANNELS = channelBit(REALORIG) | channelBit(IMAGORIG) | channelBit(REALLAST) | channelBit(IMAGLAST);
+
+static string fileName(const string &formula)
+{
+	string name = formula;
+	for(auto &c : name)
+		if(!isalnum(c))
+			c = '_';
+	return name;
+}
+
+static bool copyFile(const string &from, const string &to)
+{
+	FILE *in = fopen(from.c_str(), "rb"), *out = in ? fopen(to.c_str(), "wb") : nullptr;
+	bool ok = out;
+	char buffer[1 << 16];
+	size_t got;
+	while(ok && (got = fread(buffer, 1, sizeof(buffer), in)) > 0)
+		ok = fwrite(buffer, 1, got, out) == got;
+	if(in)
+		fclose(in);
+	if(out)
+		fclose(out);
+	return ok;
+}
+
+static void clearFolder(const string &path)
+{
+	DIR *dir = opendir(path.c_str());
+	if(!dir)
+		return;
+	while(auto entry = readdir(dir))
+		if(entry->d_name[0] != '.')
+			unlink((path + "/" + entry->d_name).c_str());
+	closedir(dir);
+}
+
+static uint32_t readBE32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Reads back the 8 bit RGB images written with filter=none.
+static bool readPNG(const string &filename, int &w, int &h, vector<uint8_t> &rgb)
+{
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if(!fp)
+		return false;
+	vector<uint8_t> file;
+	uint8_t buffer[1 << 16];
+	size_t got;
+	while((got = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		file.insert(file.end(), buffer, buffer + got);
+	fclose(fp);
+
+	vector<uint8_t> idat;
+	bool header = false;
+	for(size_t pos = 8; pos + 12 <= file.size();)
+	{
+		uint32_t len = readBE32(&file[pos]);
+		if(pos + 12 + len > file.size())
+			return false;
+		const uint8_t *chunk = &file[pos + 8];
+		if(!memcmp(&file[pos + 4], "IHDR", 4))
+		{
+			w = readBE32(chunk);
+			h = readBE32(chunk + 4);
+			header = chunk[8] == 8 && chunk[9] == 2 && !chunk[12];
+		}
+		else if(!memcmp(&file[pos + 4], "IDAT", 4))
+			idat.insert(idat.end(), chunk, chunk + len);
+		pos += 12 + len;
+	}
+	if(!header)
+		return false;
+
+	size_t rowLen = (size_t)w * 3;
+	vector<uint8_t> raw((rowLen + 1) * h);
+	uLongf rawLen = raw.size();
+	if(uncompress(raw.data(), &rawLen, idat.data(), idat.size()) != Z_OK || rawLen != raw.size())
+		return false;
+	rgb.resize(rowLen * h);
+	for(int y = 0; y < h; ++y)
+	{
+		if(raw[y * (rowLen + 1)])
+			return false;
+		memcpy(&rgb[y * rowLen], &raw[y * (rowLen + 1) + 1], rowLen);
+	}
+	return true;
+}
+
+void GoldenRun::check(bool ok, const string &what)
+{
+	printf("%s %s\n", ok ? "ok  " : "FAIL", what.c_str());
+	fflush(stdout);
+	if(!ok)
+		++failures;
+}
+
+bool GoldenRun::run()
+{
+	string golden = folder + "/golden", work = folder + "/work";
+	mkdir(folder.c_str(), 0777);
+	mkdir(golden.c_str(), 0777);
+	mkdir(work.c_str(), 0777);
+	mkdir((work + "/storage").c_str(), 0777);
+	clearFolder(work + "/storage");
+	if(chdir(work.c_str()))
+	{
+		fprintf(stderr, "could not enter '%s'\n", work.c_str());
+		return false;
+	}
+	golden = "../golden/";
+
+	// a storage of its own, so nothing is found from earlier runs
+	Storage store;
+	store.uidC = 0;
+	for(auto &f : FormulaManager::formulas)
+	{
+		string name = fileName(f.first);
+		printf("--> %s\n", f.first.c_str());
+
+		double seconds;
+		auto s = calculate(store, f.first, seconds);
+		if(!s)
+		{
+			check(false, name + " calculation");
+			continue;
+		}
+		// a retry calculates into a dataset of its own, which is dropped
+		checkTime(name + " calculation", seconds, [&]{
+			size_t at = find(store.saves.begin(), store.saves.end(), s) - store.saves.begin();
+			store.saves.erase(store.saves.begin() + at);
+			double again = seconds;
+			auto retry = calculate(store, f.first, again);
+			if(retry)
+			{
+				store.saves.erase(find(store.saves.begin(), store.saves.end(), retry));
+				delete retry;
+			}
+			store.saves.insert(store.saves.begin() + at, s);
+			return again;
+		});
+
+		string data = "storage/storage_" + to_string(s->uid) + ".data";
+		if(update)
+			check(copyFile(data, golden + name + ".data"), name + " channels updated");
+		else
+			check(compareData(s, golden + name + ".data"), name + " channels");
+
+		double renderTime = 0;
+		for(string type : {"hits", "fractal", "origin", "direction"})
+		{
+			string file = name + "_" + type + ".png";
+			ViewWindow vw(s, type);
+			bool written;
+			renderTime += render(s, type, file, written);
+			if(!written)
+				check(false, name + " " + type + " render");
+			else if(update)
+				check(copyFile(file, golden + file), name + " " + type + " render updated");
+			else
+				check(compareRender(file, golden + file, ViewWindow::requiredChannels(type) & FLOATCHANNELS ? 1 : 0), name + " " + type + " render");
+		}
+		checkTime(name + " renders", renderTime, [&]{
+			double again = 0;
+			bool written;
+			for(string type : {"hits", "fractal", "origin", "direction"})
+				again += render(s, type, name + "_" + type + ".png", written);
+			return again;
+		});
+	}
+
+	printf("%d failures\n", failures);
+	return !failures;
+}
+
+// Calculates formula for GOLDENSTEPS steps into a new dataset of store;
+// nullptr if the job could not be set up.
+StorageElement *GoldenRun::calculate(Storage &store, const string &formula, double &seconds)
+{
+	char buf[512];
+	snprintf(buf, sizeof(buf), "%s", formula.c_str());
+	bool ok = true;
+	auto start = steady_clock::now();
+	auto calc = new Calculator(buf, GOLDENWIDTH, GOLDENHEIGHT, GOLDENITERATIONS, GOLDENDIVERGENCE, 0, 4, 3, 0, 1, "full", "grid", OrbitFilter(), {}, &ok, &store);
+	if(!ok)
+	{
+		delete calc;
+		return nullptr;
+	}
+	calc->stopAfter = GOLDENSTEPS;
+	calc->startCalculation();
+	while(calc->storageElem->computedSteps < GOLDENSTEPS)
+		this_thread::sleep_for(milliseconds(1));
+	calc->stopCalculation();
+	auto s = calc->storageElem;
+	delete calc;
+	store.sync();
+	seconds = duration<double>(steady_clock::now() - start).count();
+	return s;
+}
+
+double GoldenRun::render(StorageElement *s, const string &type, const string &file, bool &written)
+{
+	ViewWindow vw(s, type);
+	vw.exportOptions.filter = 0;
+	auto start = steady_clock::now();
+	written = vw.setColormap() && vw.createToFile(file);
+	return duration<double>(steady_clock::now() - start).count();
+}
+
+// Integer channels have to match exactly; float channels are sums whose
+// order depends on the thread timing.
+bool GoldenRun::compareData(StorageElement *s, const string &golden)
+{
+	struct stat st;
+	if(stat(golden.c_str(), &st))
+	{
+		fprintf(stderr, "no golden file '%s', create it with update\n", golden.c_str());
+		return false;
+	}
+	TileCache reference;
+	reference.open(golden, s->width, s->height, s->channels);
+	s->aquireData();
+	long differences = 0;
+	for(int t = 0; t < s->data.tileCount(); ++t)
+	{
+		int x0, y0, w, h;
+		s->data.tileRect(t, x0, y0, w, h);
+		PixelColumns a = s->data.pin(t, ALLCHANNELS), b = reference.pin(t, ALLCHANNELS);
+		for(int c = 0; c < CHANNELCOUNT; ++c)
+		{
+			bool narrow = c == HITS && a.hits32;
+			if(!a.words[c] && !narrow)
+				continue;
+			for(int i = 0; i < w * h; ++i)
+			{
+				uint64_t u = narrow ? a.hits32[i] : a.words[c][i], v = b.hits32 && c == HITS ? b.hits32[i] : b.words[c][i];
+				double x = u, y = v;
+				bool same = u == v;
+				if(channelIsFloat(c))
+				{
+					memcpy(&x, &u, sizeof(x));
+					memcpy(&y, &v, sizeof(y));
+					same = fabs(x - y) <= FLOATTOLERANCE * max(1., max(fabs(x), fabs(y)));
+				}
+				if(!same && !differences++)
+					fprintf(stderr, "%s at (%d, %d): %.17g instead of %.17g\n", channelNames[c], x0 + i % w, y0 + i / w, x, y);
+			}
+		}
+		reference.unpin(t);
+		s->data.unpin(t);
+	}
+	s->releaseData();
+	if(differences)
+		fprintf(stderr, "%ld values differ\n", differences);
+	return !differences;
+}
+
+bool GoldenRun::compareRender(const string &file, const string &golden, int tolerance)
+{
+	int w, h, gw, gh;
+	vector<uint8_t> a, b;
+	if(!readPNG(golden, gw, gh, b))
+	{
+		fprintf(stderr, "could not read golden image '%s', create it with update\n", golden.c_str());
+		return false;
+	}
+	if(!readPNG(file, w, h, a) || w != gw || h != gh)
+	{
+		fprintf(stderr, "'%s' is not a %dx%d image\n", file.c_str(), gw, gh);
+		return false;
+	}
+	long differences = 0;
+	int worst = 0;
+	for(size_t i = 0; i < a.size(); ++i)
+	{
+		int d = abs(a[i] - b[i]);
+		worst = max(worst, d);
+		differences += d > tolerance;
+	}
+	if(differences)
+		fprintf(stderr, "%ld samples of '%s' differ, by up to %d\n", differences, file.c_str(), worst);
+	return !differences;
+}
+
+// Compares with the median of the last PERFRUNS times recorded for name
+// and records this one, dropping all but its last PERFHISTORY times. A
+// single slow run is mostly scheduler noise, so measure repeats it up to
+// PERFRETRIES times and the fastest counts.
+void GoldenRun::checkTime(const string &name, double seconds, function<double(void)> measure)
+{
+	const string history = "../history.txt";
+	struct Entry
+	{
+		long long when;
+		double seconds;
+		string name;
+	};
+	vector<Entry> entries;
+	vector<double> past;
+	FILE *fp = fopen(history.c_str(), "r");
+	if(fp)
+	{
+		long long when;
+		double t;
+		char line[1024];
+		while(fscanf(fp, "%lld %lf %1023[^\n]\n", &when, &t, line) == 3)
+		{
+			entries.push_back({when, t, line});
+			if(line == name)
+				past.push_back(t);
+		}
+		fclose(fp);
+	}
+	size_t keep = past.size() >= PERFHISTORY ? past.size() - PERFHISTORY + 1 : 0;
+	if(past.size() > PERFRUNS)
+		past.erase(past.begin(), past.end() - PERFRUNS);
+
+	if(past.empty())
+		printf("     %s took %.3fs\n", name.c_str(), seconds);
+	else
+	{
+		nth_element(past.begin(), past.begin() + past.size() / 2, past.end());
+		double median = past[past.size() / 2];
+		double limit = median * PERFSLACK + PERFNOISE;
+		printf("     %s took %.3fs, median of the last %d runs %.3fs\n", name.c_str(), seconds, (int)past.size(), median);
+		for(int retry = 0; !update && seconds > limit && retry < PERFRETRIES; ++retry)
+		{
+			double again = measure();
+			printf("     %s took %.3fs again\n", name.c_str(), again);
+			seconds = min(seconds, again);
+		}
+		if(!update)
+			check(seconds <= limit, name + " time");
+	}
+
+	// the oldest times of name beyond PERFHISTORY are dropped
+	entries.erase(remove_if(entries.begin(), entries.end(), [&](const Entry &e){
+		return e.name == name && keep && keep--;
+	}), entries.end());
+	entries.push_back({(long long)time(nullptr), seconds, name});
+	string temp = history + ".new";
+	fp = fopen(temp.c_str(), "w");
+	if(!fp)
+		return;
+	for(auto &e : entries)
+		fprintf(fp, "%lld %.6f %s\n", e.when, e.seconds, e.name.c_str());
+	fclose(fp);
+	rename(temp.c_str(), history.c_str());
+}
@@ -0,0 +1,39 @@
+#ifndef _GOLDEN_H_
+#define _GOLDEN_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Storage.h"
+
+using namespace std;
+
+// Regression check, run as mbmanager --golden <folder> [update]. Every
+// formula is calculated for GOLDENSTEPS steps on a small fixed dataset in
+// <folder>/work, then its channels and its renders in every mode are
+// compared with the files in <folder>/golden: integer channels and the
+// renders of integer channels exactly, float channels and the renders based
+// on them within a tolerance for the order sums happen in. With update the
+// results become the new golden files instead.
+//
+// The calculation and render times go to <folder>/history.txt, which keeps
+// the last PERFHISTORY runs of each. One slower than PERFSLACK times the
+// median of the last few runs is measured again, and fails the check like a
+// wrong result if every retry is still that slow.
+struct GoldenRun
+{
+	string folder;
+	bool update = false;
+	int failures = 0;
+
+	bool run();
+	void check(bool ok, const string &what);
+	StorageElement *calculate(Storage &store, const string &formula, double &seconds);
+	double render(StorageElement *s, const string &type, const string &file, bool &written);
+	bool compareData(StorageElement *s, const string &golden);
+	bool compareRender(const string &file, const string &golden, int tolerance);
+	void checkTime(const string &name, double seconds, function<double(void)> measure);
+};
+
+#endif
@@ -0,0 +1,43 @@
+#include "Isa.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+const char *isaNames[ISACOUNT] = {"base", "avx2", "avx512"};
+Isa isa = ISABASE;
+
+Isa detectIsa()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+		return ISAAVX512;
+	if(__builtin_cpu_supports("avx2"))
+		return ISAAVX2;
+#endif
+	return ISABASE;
+}
+
+void selectIsa()
+{
+	Isa best = detectIsa();
+	isa = best;
+	const char *forced = getenv("MBMANAGER_ISA");
+	if(forced && *forced)
+	{
+		int i = 0;
+		while(i < ISACOUNT && strcmp(isaNames[i], forced))
+			++i;
+		if(i == ISACOUNT)
+			fprintf(stderr, "unknown MBMANAGER_ISA '%s', expected base, avx2 or avx512\n", forced);
+		else if(i > best)
+			fprintf(stderr, "this CPU does not support %s\n", forced);
+		else
+			isa = (Isa)i;
+	}
+	if(isa == best)
+		printf("using the %s kernels\n", isaNames[isa]);
+	else
+		printf("using the %s kernels, %s supported\n", isaNames[isa], isaNames[best]);
+}
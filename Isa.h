@@ -0,0 +1,38 @@
+#ifndef _ISA_H_
+#define _ISA_H_
+
+// The formula kernels, the merge and the render passes are compiled once per
+// instruction set and the variant for the widest one the CPU has is chosen
+// at startup, so one build runs everywhere. MBMANAGER_ISA=base|avx2|avx512
+// forces a variant, e.g. to compare them on one machine. Other than on x86
+// only the generic kernels are built.
+enum Isa
+{
+	ISABASE, ISAAVX2, ISAAVX512, ISACOUNT
+};
+
+extern const char *isaNames[ISACOUNT];
+// the chosen variant, ISABASE until selectIsa ran
+extern Isa isa;
+
+Isa detectIsa();
+void selectIsa();
+
+// The body of a kernel, inlined into each variant.
+#define ISAINLINE inline __attribute__((always_inline))
+
+#if defined(__x86_64__) || defined(__i386__)
+// Defines name##Avx2 and name##Avx512, copies of the ISAINLINE function
+// name compiled for those instruction sets.
+#define ISAVARIANTS(ret, name, params, args) \
+	__attribute__((target("avx2"))) static ret name##Avx2 params { return name args; } \
+	__attribute__((target("avx512f,avx512bw,avx512dq,avx512vl"))) static ret name##Avx512 params { return name args; }
+
+// the variant of name for the chosen instruction set
+#define ISASELECT(name) (isa == ISAAVX512 ? name##Avx512 : isa == ISAAVX2 ? name##Avx2 : name)
+#else
+#define ISAVARIANTS(ret, name, params, args)
+#define ISASELECT(name) name
+#endif
+
+#endif
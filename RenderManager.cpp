@@ -1,297 +1,1826 @@
 #include "RenderManager.h"
-#include <png.h>
+#include "Isa.h"
+#include <zlib.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <unistd.h>
 
 const double PI = acos(-1);
 
+constexpr int RENDERWORKERS = 4;
+constexpr size_t RENDERMEMORY = 2048UL*1024*1024;
+constexpr Uint32 LIVEINTERVAL = 500;
+constexpr int PREPAREWORKERS = 2;
+constexpr int VIEWTILES = 256;
+constexpr int TILEBATCH = 8;
+constexpr int SAMPLETILES = 64;
+constexpr int SAMPLEKEYS = 1 << 20;
+constexpr double MINZOOM = 1 / 8.;
+constexpr int STREAMKEYS = 1 << 22;
+constexpr int FRAMEWIDTH = 1920, FRAMEHEIGHT = 1080;
+constexpr size_t FRAMEQUEUE = 4;
+// part of every render cache key; raise it when the renderer's output changes
+constexpr int RENDERFORMAT = 1;
+
 template<typename T>
 T clamp(const T &val, const T &mi, const T &ma)
 {
 	return max(mi, min(ma, val));
 } 
 
-int createHSLColor(double h, double s, double l) { 
-	double c = (1-abs(2*l-1))*s; 
-	double hs = h * 6;
-	double x = c * (1-abs(fmod(hs, 2)-1));
+// Runs fn(thread, begin, end) over [0, n) split into one chunk per core. The
+// split only depends on n, so passes over the same range line up.
+static void parallelChunks(size_t n, function<void(int, size_t, size_t)> fn)
+{
+	int threads = max(1u, thread::hardware_concurrency());
+	if(n < 65536)
+		threads = 1;
+	vector<thread> pool;
+	for(int t = 1; t < threads; ++t)
+		pool.emplace_back(fn, t, n * t / threads, n * (t + 1) / threads);
+	fn(0, 0, n / threads);
+	for(auto &t : pool)
+		t.join();
+}
+
+static int chunkCount(size_t n)
+{
+	return n < 65536 ? 1 : max(1u, thread::hardware_concurrency());
+}
+
+static void parallelRows(int rows, function<void(int)> fn)
+{
+	parallelChunks(rows, [&](int, size_t begin, size_t end){
+		for(size_t y = begin; y < end; ++y)
+			fn(y);
+	});
+}
+
+// Runs fn(i) for i in [0, n) on one thread per core, for a few heavy tasks
+// of uneven cost.
+static void parallelTasks(int n, function<void(int)> fn)
+{
+	atomic<int> next(0);
+	auto work = [&]{
+		for(int i = next++; i < n; i = next++)
+			fn(i);
+	};
+	vector<thread> pool;
+	for(int t = 1; t < min<int>(n, thread::hardware_concurrency()); ++t)
+		pool.emplace_back(work);
+	work();
+	for(auto &t : pool)
+		t.join();
+}
+
+// Maps a double to a key with the same order; -0 and 0 share a key.
+static uint64_t doubleKey(double d)
+{
+	if(d == 0)
+		d = 0;
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return bits >> 63 ? ~bits : bits | (1ULL << 63);
+}
+
+// ranks[i] is the number of keys smaller than keys[i], which is where
+// lower_bound finds keys[i] in the sorted keys. Sorts (key, index) pairs with
+// a stable parallel LSD radix sort over 16 bit digits, skipping digits that
+// are the same for all keys.
+static void rankKeys(const vector<uint64_t> &keys, vector<uint32_t> &ranks)
+{
+	constexpr int BUCKETS = 1 << 16;
+	size_t n = keys.size();
+	int threads = chunkCount(n);
+	vector<uint64_t> k(keys), k2(n);
+	vector<uint32_t> idx(n), idx2(n);
+	for(size_t i = 0; i < n; ++i)
+		idx[i] = i;
+
+	vector<size_t> counts((size_t)threads * BUCKETS);
+	for(int shift = 0; shift < 64; shift += 16)
+	{
+		fill(counts.begin(), counts.end(), 0);
+		parallelChunks(n, [&](int t, size_t begin, size_t end){
+			size_t *c = &counts[(size_t)t * BUCKETS];
+			for(size_t i = begin; i < end; ++i)
+				c[(k[i] >> shift) & (BUCKETS - 1)]++;
+		});
+
+		size_t sum = 0;
+		bool constant = false;
+		for(int d = 0; d < BUCKETS; ++d)
+		{
+			size_t digit = 0;
+			for(int t = 0; t < threads; ++t)
+			{
+				size_t c = counts[(size_t)t * BUCKETS + d];
+				counts[(size_t)t * BUCKETS + d] = sum + digit;
+				digit += c;
+			}
+			constant |= digit == n;
+			sum += digit;
+		}
+		if(constant)
+			continue;
+
+		parallelChunks(n, [&](int t, size_t begin, size_t end){
+			size_t *c = &counts[(size_t)t * BUCKETS];
+			for(size_t i = begin; i < end; ++i)
+			{
+				size_t to = c[(k[i] >> shift) & (BUCKETS - 1)]++;
+				k2[to] = k[i];
+				idx2[to] = idx[i];
+			}
+		});
+		k.swap(k2);
+		idx.swap(idx2);
+	}
+	vector<uint64_t>().swap(k2);
+	vector<uint32_t>().swap(idx2);
+
+	// equal keys get the position of the first one; a run may span several
+	// chunks, so the start of the run each chunk ends in is carried over
+	ranks.resize(n);
+	vector<size_t> lastStart(threads), chunkBegin(threads + 1);
+	for(int t = 0; t <= threads; ++t)
+		chunkBegin[t] = n * t / threads;
+	parallelChunks(n, [&](int t, size_t begin, size_t end){
+		size_t s = begin;
+		for(size_t i = begin + 1; i < end; ++i)
+			if(k[i] != k[i - 1])
+				s = i;
+		lastStart[t] = s;
+	});
+	vector<size_t> carry(threads, 0);
+	for(int t = 1; t < threads; ++t)
+	{
+		size_t prev = lastStart[t - 1];
+		if(prev == chunkBegin[t - 1] && t > 1 && chunkBegin[t - 1] < n && k[chunkBegin[t - 1]] == k[chunkBegin[t - 1] - 1])
+			prev = carry[t - 1];
+		carry[t] = prev;
+	}
+	parallelChunks(n, [&](int t, size_t begin, size_t end){
+		size_t s = begin;
+		if(t && begin < end && k[begin] == k[begin - 1])
+			s = carry[t];
+		for(size_t i = begin; i < end; ++i)
+		{
+			if(i > begin && k[i] != k[i - 1])
+				s = i;
+			ranks[idx[i]] = s;
+		}
+	});
+}
+
+ViewWindow::ViewWindow(StorageElement*elem, string t, int maxW, int maxH)
+{
+	storage = elem;
+	type = t;
+	maxWidth = maxW;
+	maxHeight = maxH;
+}
+
+ViewWindow::~ViewWindow()
+{
+	close();
+	if(pixels)
+	{
+		delete[] pixels;
+		pixels = 0;
+	}
+	if(field)
+	{
+		delete[] field;
+		field = 0;
+	}
+}
+
+uint32_t ViewWindow::requiredChannels(const string &type)
+{
+	if(type == "origin" || type == "direction")
+		return ORIGINCHANNELS;
+	if(type == "fractal")
+		return channelBit(STARTHITS) | channelBit(STARTSTEPS);
+	return channelBit(HITS);
+}
+
+bool ViewWindow::checkChannels(StorageElement *storage, const string &type)
+{
+	uint32_t missing = requiredChannels(type) & ~storage->channels;
+	if(!missing)
+		return true;
+	fprintf(stderr, "render type '%s' needs %s, which dataset %d does not store (profile %s)\n", type.c_str(), channelList(missing).c_str(), storage->uid, storage->profile.c_str());
+	return false;
+}
+
+// Picks the largest pyramid level that fits into maxWidth x maxHeight.
+void ViewWindow::chooseLevel()
+{
+	level = storage->levelFor(maxWidth, maxHeight);
+	width = storage->levelWidth(level);
+	height = storage->levelHeight(level);
+}
+
+void ViewWindow::create()
+{
+	if(!maxWidth && !maxHeight)
+	{
+		SDL_DisplayMode mode;
+		if(!SDL_GetDesktopDisplayMode(0, &mode))
+		{
+			maxWidth = mode.w * 9 / 10;
+			maxHeight = mode.h * 9 / 10;
+		}
+	}
+	chooseLevel();
+
+	SDL_CreateWindowAndRenderer(width, height, SDL_WINDOW_SHOWN, &window, &renderer);
+
+	char buffer[512];
+	sprintf(buffer, "%s | %dx%d | s: %d | d: %d | cw: %lf | ch: %lf | level %d", storage->formula.c_str(), storage->width, storage->height, storage->steps, storage->divergenceThreshold, storage->complexWidth, storage->complexHeight, level);
+	SDL_SetWindowTitle(window, buffer);
+
+	pixels = new Uint32[width * height];
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+	lastRendered = -1;
+	zoom = 1 << level;
+}
+
+// Destroys the SDL side of a closed window; a preparation that is still
+// running only finishes its current pass.
+void ViewWindow::close()
+{
+	cancelled = true;
+	for(auto &t : tiles)
+		SDL_DestroyTexture(t.second.texture);
+	tiles.clear();
+	if(texture)
+	{
+		SDL_DestroyTexture(texture);
+		texture = 0;
+	}
+	if(renderer)
+	{
+		SDL_DestroyRenderer(renderer);
+		renderer = 0;
+	}
+	if(window)
+	{
+		SDL_DestroyWindow(window);
+		window = 0;
+	}
+}
+
+static bool isPFM(const string &filename)
+{
+	return filename.size() > 4 && filename.substr(filename.size() - 4) == ".pfm";
+}
+
+// Renders in one piece when the image and its ranking buffers fit into
+// RENDERMEMORY, else and for box scaling band by band.
+bool ViewWindow::createToFile(string filename)
+{
+	if(!checkChannels(storage, type))
+		return false;
+	chooseLevel();
+	size_t bytes = (size_t)width * height * (sizeof(Uint32) + 3 * sizeof(float) + sizeof(uint64_t) + sizeof(uint32_t) + 2 * 6);
+	if(exportOptions.box || exportOptions.stream > 0 || (exportOptions.stream < 0 && bytes > RENDERMEMORY))
+		return streamToFile(filename);
+	pixels = new Uint32[width * height];
+	if(exportOptions.depth == 16 || isPFM(filename))
+		field = new float[width * height * 3];
+	renderPrepare();
+	if(isPFM(filename))
+		return writePFM(filename);
+	return writePNG(filename);
+}
+
+// Everything the image createToFile writes depends on. A palette counts
+// with its modification time.
+string ViewWindow::cacheKey()
+{
+	auto &o = exportOptions;
+	string palette = o.palette;
+	struct stat st;
+	if(!palette.empty() && !stat(palette.c_str(), &st))
+		palette += "@" + to_string((long long)st.st_mtime);
+	char buffer[1024];
+	snprintf(buffer, sizeof(buffer), "v%d dataset=%d steps=%d type=%s max=%dx%d level=%d filter=%d strategy=%d depth=%d stream=%d box=%d palette=%s",
+			RENDERFORMAT, storage->uid, storage->computedSteps, type.c_str(), maxWidth, maxHeight,
+			o.level, o.filter, o.strategy, o.depth, o.stream, o.box, palette.c_str());
+	return buffer;
+}
+
+bool ViewWindow::setColormap()
+{
+	return colormap.build(type, exportOptions.palette);
+}
+
+bool ExportOptions::parse(const string &option)
+{
+	static const vector<string> filters = {"none", "sub", "up", "average", "paeth"};
+	static const vector<string> strategies = {"default", "filtered", "huffman", "rle", "fixed"};
+	auto eq = option.find('=');
+	if(eq == string::npos)
+		return false;
+	string key = option.substr(0, eq), val = option.substr(eq + 1);
+	if(key == "level" && val.size() == 1 && isdigit(val[0]))
+		level = val[0] - '0';
+	else if(key == "depth" && (val == "8" || val == "16"))
+		depth = stoi(val);
+	else if(key == "filter" && val == "adaptive")
+		filter = -1;
+	else if(key == "filter" && find(filters.begin(), filters.end(), val) != filters.end())
+		filter = find(filters.begin(), filters.end(), val) - filters.begin();
+	else if(key == "strategy" && find(strategies.begin(), strategies.end(), val) != strategies.end())
+		strategy = find(strategies.begin(), strategies.end(), val) - strategies.begin();
+	else if(key == "palette" && val.size())
+		palette = val;
+	else if(key == "stream" && (val == "0" || val == "1"))
+		stream = stoi(val);
+	else if(key == "scale" && (val == "box" || val == "level"))
+		box = val == "box";
+	else
+		return false;
+	return true;
+}
+
+string ViewWindow::description()
+{
+	char buffer[512];
+	sprintf(buffer, "Formula: %s\n"
+			"Resolution: %dx%d\n"
+			"Steps: %d\n"
+			"Skip: %d\n"
+			"Divergence Threshold: %d\n"
+			"Complex Plane: (%lf - %lf) x (%lf - %lf)\n"
+			"Rendertype: %s\n"
+			"Computed Steps: %d%s",
+			storage->formula.c_str(),
+			storage->width, storage->height,
+			storage->steps,
+			storage->skipPoints,
+			storage->divergenceThreshold,
+			storage->centerReal - storage->complexWidth / 2, storage->centerReal + storage->complexWidth / 2,
+			storage->centerImag - storage->complexHeight / 2, storage->centerImag + storage->complexHeight / 2,
+			type.c_str(),
+			storage->computedSteps,
+			level ? ("\nPyramid Level: " + to_string(level)).c_str() : "");
+	return buffer;
+}
+
+static void putBE32(uint8_t *out, uint32_t v)
+{
+	out[0] = v >> 24;
+	out[1] = v >> 16;
+	out[2] = v >> 8;
+	out[3] = v;
+}
+
+// False if the file could not take all of it.
+static bool writeChunk(FILE *fp, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t head[8], tail[4];
+	putBE32(head, len);
+	memcpy(head + 4, type, 4);
+	uint32_t crc = crc32(0, head + 4, 4);
+	if(len)
+		crc = crc32(crc, data, len);
+	putBE32(tail, crc);
+	bool ok = fwrite(head, 1, 8, fp) == 8;
+	if(len)
+		ok &= fwrite(data, 1, len, fp) == len;
+	return ok && fwrite(tail, 1, 4, fp) == 4;
+}
+
+static uint8_t paeth(int a, int b, int c)
+{
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if(pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+// Applies PNG filter type to one scanline; prev is the unfiltered line
+// above or null for the first one.
+static ISAINLINE void filterRow(int type, const uint8_t *row, const uint8_t *prev, int bpp, size_t len, uint8_t *out)
+{
+	for(size_t i = 0; i < len; ++i)
+	{
+		int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+		int b = prev ? prev[i] : 0;
+		int c = prev && i >= (size_t)bpp ? prev[i - bpp] : 0;
+		switch(type)
+		{
+			case 0: out[i] = row[i]; break;
+			case 1: out[i] = row[i] - a; break;
+			case 2: out[i] = row[i] - b; break;
+			case 3: out[i] = row[i] - (a + b) / 2; break;
+			case 4: out[i] = row[i] - paeth(a, b, c); break;
+		}
+	}
+}
+ISAVARIANTS(void, filterRow, (int type, const uint8_t *row, const uint8_t *prev, int bpp, size_t len, uint8_t *out), (type, row, prev, bpp, len, out))
+
+// Writes a PNG band by band, so an image never has to be in memory as a
+// whole. The rows of a band are filtered in parallel and deflated in pieces
+// on their own threads, each piece with the 32K before it as dictionary and
+// ending in a sync flush. The pieces of all bands join into one zlib stream
+// whose checksum is combined from theirs. A failed write or deflate is
+// remembered and reported by close.
+struct PNGWriter
+{
+	FILE *fp = 0;
+	ExportOptions opt;
+	int bpp = 0;
+	size_t rowLen = 0;
+	vector<uint8_t> prev, dict, idat;
+	uLong adler = 1;
+	bool failed = false;
+
+	bool open(const string &filename, int width, int height, int depth, const ExportOptions &options, const vector<pair<string, string>> &text);
+	void writeRows(const uint8_t *samples, int rows);
+	void flush(bool all);
+	bool close();
+};
+
+bool PNGWriter::open(const string &filename, int width, int height, int depth, const ExportOptions &options, const vector<pair<string, string>> &text)
+{
+	fp = fopen(filename.c_str(), "wb");
+	if(!fp)
+		return false;
+	opt = options;
+	bpp = 3 * depth / 8;
+	rowLen = (size_t)width * bpp;
+
+	static const uint8_t signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+	failed = fwrite(signature, 1, 8, fp) != 8;
+
+	uint8_t ihdr[13];
+	putBE32(ihdr, width);
+	putBE32(ihdr + 4, height);
+	ihdr[8] = depth;
+	ihdr[9] = 2;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	failed |= !writeChunk(fp, "IHDR", ihdr, 13);
+
+	for(auto &t : text)
+	{
+		string chunk = t.first + "\0"s + t.second;
+		failed |= !writeChunk(fp, "tEXt", (const uint8_t*)chunk.data(), chunk.size());
+	}
+
+	int flevel = opt.level < 2 ? 0 : opt.level < 6 ? 1 : opt.level == 6 ? 2 : 3;
+	int flg = flevel << 6;
+	flg += (31 - (0x78 * 256 + flg) % 31) % 31;
+	idat = {0x78, (uint8_t)flg};
+	return true;
+}
+
+void PNGWriter::writeRows(const uint8_t *samples, int rows)
+{
+	size_t lineLen = rowLen + 1;
+	vector<uint8_t> raw(lineLen * rows);
+	parallelRows(rows, [&](int y){
+		const uint8_t *row = samples + rowLen * y;
+		const uint8_t *above = y ? row - rowLen : prev.size() ? prev.data() : nullptr;
+		uint8_t *line = &raw[lineLen * y];
+		if(opt.filter >= 0)
+		{
+			line[0] = opt.filter;
+			ISASELECT(filterRow)(opt.filter, row, above, bpp, rowLen, line + 1);
+			return;
+		}
+		// adaptive: the filter with the smallest sum of signed bytes
+		vector<uint8_t> trial(rowLen);
+		uint64_t best = UINT64_MAX;
+		for(int f = 0; f < 5; ++f)
+		{
+			ISASELECT(filterRow)(f, row, above, bpp, rowLen, trial.data());
+			uint64_t sum = 0;
+			for(auto v : trial)
+				sum += abs((int8_t)v);
+			if(sum < best)
+			{
+				best = sum;
+				line[0] = f;
+				copy(trial.begin(), trial.end(), line + 1);
+			}
+		}
+	});
+	prev.assign(samples + rowLen * (rows - 1), samples + rowLen * rows);
+
+	constexpr size_t MINPIECE = 256 * 1024, DICT = 32768;
+	size_t pieces = max<size_t>(1, min<size_t>(max(1u, thread::hardware_concurrency()), raw.size() / MINPIECE));
+	vector<vector<uint8_t>> out(pieces);
+	vector<uLong> sums(pieces);
+	vector<char> deflated(pieces);
+	auto bound = [&](size_t p){ return rows * p / pieces * lineLen; };
+	auto work = [&](size_t p){
+		size_t begin = bound(p), end = bound(p + 1);
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		if(deflateInit2(&zs, opt.level, Z_DEFLATED, -15, 8, opt.strategy) != Z_OK)
+			return;
+		int ret = Z_OK;
+		if(begin)
+		{
+			size_t d = min(DICT, begin);
+			ret = deflateSetDictionary(&zs, &raw[begin - d], d);
+		}
+		else if(dict.size())
+			ret = deflateSetDictionary(&zs, dict.data(), dict.size());
+		auto &o = out[p];
+		o.resize(deflateBound(&zs, end - begin) + 16);
+		zs.next_in = (Bytef*)&raw[begin];
+		zs.avail_in = end - begin;
+		zs.next_out = o.data();
+		zs.avail_out = o.size();
+		if(ret == Z_OK)
+			ret = deflate(&zs, Z_SYNC_FLUSH);
+		// all input has to be consumed, with room left for the flush marker
+		deflated[p] = ret == Z_OK && !zs.avail_in && zs.avail_out;
+		o.resize(zs.total_out);
+		// the piece is never finished, so deflateEnd reports discarded
+		// state and has nothing to tell
+		deflateEnd(&zs);
+		sums[p] = adler32(adler32(0, 0, 0), &raw[begin], end - begin);
+	};
+	vector<thread> pool;
+	for(size_t p = 1; p < pieces; ++p)
+		pool.emplace_back(work, p);
+	work(0);
+	for(auto &t : pool)
+		t.join();
+
+	for(size_t p = 0; p < pieces; ++p)
+	{
+		failed |= !deflated[p];
+		idat.insert(idat.end(), out[p].begin(), out[p].end());
+		adler = adler32_combine(adler, sums[p], bound(p + 1) - bound(p));
+	}
+	if(raw.size() >= DICT)
+		dict.assign(raw.end() - DICT, raw.end());
+	else
+	{
+		dict.insert(dict.end(), raw.begin(), raw.end());
+		if(dict.size() > DICT)
+			dict.erase(dict.begin(), dict.end() - DICT);
+	}
+	flush(false);
+}
+
+// Writes the collected stream as IDAT chunks of IDATSIZE; the rest waits
+// for more rows unless all is set.
+void PNGWriter::flush(bool all)
+{
+	constexpr size_t IDATSIZE = 1 << 20;
+	size_t pos = 0;
+	while(pos < idat.size() && (all || idat.size() - pos >= IDATSIZE))
+	{
+		size_t len = min(IDATSIZE, idat.size() - pos);
+		failed |= !writeChunk(fp, "IDAT", &idat[pos], len);
+		pos += len;
+	}
+	idat.erase(idat.begin(), idat.begin() + pos);
+}
+
+// Ends the stream with an empty final block and the checksum. False if
+// anything of the image failed.
+bool PNGWriter::close()
+{
+	idat.insert(idat.end(), {0x03, 0x00, 0, 0, 0, 0});
+	putBE32(&idat[idat.size() - 4], adler);
+	flush(true);
+	failed |= !writeChunk(fp, "IEND", nullptr, 0);
+	failed |= fclose(fp) != 0;
+	fp = 0;
+	return !failed;
+}
+
+// Samples of n pixels of normalized colours, as PNG stores them.
+static ISAINLINE void putSamples(const float *rgb, int n, int depth, uint8_t *out)
+{
+	for(int i = 0; i < n * 3; ++i)
+	{
+		if(depth == 16)
+		{
+			uint16_t v = clamp(rgb[i], 0.f, 1.f) * 65535 + 0.5f;
+			out[i * 2] = v >> 8;
+			out[i * 2 + 1] = v;
+		}
+		else
+			out[i] = (int)(clamp(rgb[i], 0.f, 1.f) * 255);
+	}
+}
+ISAVARIANTS(void, putSamples, (const float *rgb, int n, int depth, uint8_t *out), (rgb, n, depth, out))
+
+vector<pair<string, string>> ViewWindow::pngText()
+{
+	char buffer[512];
+	sprintf(buffer, "%s (%s)", storage->formula.c_str(), type.c_str());
+	return {{"Title", buffer}, {"Description", description()}, {"Source", "MandelBuddhaManager by Jujuedv"}};
+}
+
+bool ViewWindow::writePNG(string filename)
+{
+	int depth = field ? exportOptions.depth : 8;
+	PNGWriter png;
+	if(!png.open(filename, width, height, depth, exportOptions, pngText()))
+	{
+		fprintf(stderr, "Error on save... aborting...\n");
+		return false;
+	}
+
+	// bands of about 32M samples
+	int band = max<size_t>(1, (32 << 20) / png.rowLen);
+	vector<uint8_t> samples;
+	for(int y0 = 0; y0 < height; y0 += band)
+	{
+		int rows = min(band, height - y0);
+		samples.resize(png.rowLen * rows);
+		parallelRows(rows, [&](int r){
+			int y = y0 + r;
+			uint8_t *row = &samples[png.rowLen * r];
+			if(depth == 16)
+			{
+				ISASELECT(putSamples)(field + (size_t)y * width * 3, width, 16, row);
+				return;
+			}
+			for(int x = 0; x < width; ++x)
+			{
+				int index = x + y * width;
+				row[x*3] = (pixels[index] >> 16) & 0xFF;
+				row[x*3+1] = (pixels[index] >> 8) & 0xFF;
+				row[x*3+2] = (pixels[index] >> 0) & 0xFF;
+			}
+		});
+		png.writeRows(samples.data(), rows);
+	}
+	if(!png.close())
+	{
+		fprintf(stderr, "Error on save... aborting...\n");
+		return false;
+	}
+	printf("saved with mode '%s' as '%s'.\n", type.c_str(), filename.c_str());
+	return true;
+}
+
+// Renders and writes the image band by band with memory bounded by a few
+// rows of tiles. The global statistics come first: hits are ranked by the
+// summary, origin and fractal against a sorted sample of up to STREAMKEYS
+// keys, which is exact for smaller images. With scale=box the colours of
+// level 0 are averaged down to exactly fit the requested size.
+bool ViewWindow::streamToFile(string filename)
+{
+	storage->aquireData();
+	if(exportOptions.box)
+		level = 0;
+	else if(level)
+		storage->buildPyramid();
+	auto &data = storage->level(level);
+	int lw = storage->levelWidth(level), lh = storage->levelHeight(level);
+
+	LevelTables tables;
+	buildTables(level, tables, 1, max<size_t>(1, ((size_t)lw * lh + STREAMKEYS - 1) / STREAMKEYS));
+
+	width = lw;
+	height = lh;
+	if(exportOptions.box && maxWidth && maxHeight)
+	{
+		double scale = min(1., min(maxWidth / (double)lw, maxHeight / (double)lh));
+		width = max(1, (int)(lw * scale));
+		height = max(1, (int)(lh * scale));
+	}
+
+	bool pfm = isPFM(filename);
+	int depth = pfm ? 32 : exportOptions.depth;
+	PNGWriter png;
+	FILE *fp = 0;
+	long header = 0;
+	if(pfm)
+	{
+		fp = fopen(filename.c_str(), "wb");
+		if(fp)
+		{
+			uint16_t one = 1;
+			bool little = *reinterpret_cast<uint8_t*>(&one);
+			fprintf(fp, "PF\n%d %d\n%s\n", width, height, little ? "-1.0" : "1.0");
+			header = ftell(fp);
+		}
+	}
+	if(pfm ? !fp : !png.open(filename, width, height, depth, exportOptions, pngText()))
+	{
+		fprintf(stderr, "Error on save... aborting...\n");
+		storage->releaseData();
+		return false;
+	}
+
+	// output rows of normalized colours; PFM stores them bottom row first
+	vector<uint8_t> samples;
+	bool written = true;
+	auto emit = [&](const float *rgb, int y0, int rows){
+		if(pfm)
+		{
+			for(int r = 0; r < rows; ++r)
+			{
+				fseek(fp, header + (long)(height - 1 - y0 - r) * width * 3 * sizeof(float), SEEK_SET);
+				written &= fwrite(rgb + (size_t)r * width * 3, sizeof(float), (size_t)width * 3, fp) == (size_t)width * 3;
+			}
+			return;
+		}
+		samples.resize(png.rowLen * rows);
+		parallelRows(rows, [&](int r){
+			ISASELECT(putSamples)(rgb + (size_t)r * width * 3, width, depth, &samples[png.rowLen * r]);
+		});
+		png.writeRows(samples.data(), rows);
+	};
+
+	// one row of tiles at a time; with box filtering every source pixel adds
+	// to the output pixel it falls into, and output rows are written once no
+	// later source row can reach them
+	int tilesX = (lw + TILESIZE - 1) / TILESIZE;
+	vector<float> band((size_t)lw * TILESIZE * 3);
+	int accRows = (int)((int64_t)TILESIZE * height / lh) + 2, accY = 0;
+	vector<float> acc, avg;
+	vector<int> count;
+	if(width != lw || height != lh)
+	{
+		acc.assign((size_t)width * accRows * 3, 0);
+		count.assign((size_t)width * accRows, 0);
+	}
+	for(int y0 = 0; y0 < lh; y0 += TILESIZE)
+	{
+		int th = min(TILESIZE, lh - y0);
+		parallelTasks(tilesX, [&](int tx){
+			int t = data.tileAt(tx * TILESIZE, y0);
+			int x0, ty0, tw, tth;
+			data.tileRect(t, x0, ty0, tw, tth);
+			vector<float> rgb((size_t)tw * th * 3);
+			colourTile(level, t, tables, rgb.data());
+			for(int y = 0; y < th; ++y)
+				copy(&rgb[(size_t)y * tw * 3], &rgb[(size_t)(y + 1) * tw * 3], &band[((size_t)y * lw + x0) * 3]);
+		});
+		if(acc.empty())
+		{
+			emit(band.data(), y0, th);
+			continue;
+		}
+
+		for(int y = 0; y < th; ++y)
+		{
+			int oy = (int)((int64_t)(y0 + y) * height / lh) - accY;
+			for(int x = 0; x < lw; ++x)
+			{
+				size_t o = (size_t)oy * width + (int64_t)x * width / lw;
+				for(int c = 0; c < 3; ++c)
+					acc[o * 3 + c] += band[((size_t)y * lw + x) * 3 + c];
+				++count[o];
+			}
+		}
+		int done = (int)((int64_t)(y0 + th) * height / lh) - accY;
+		avg.resize((size_t)width * done * 3);
+		for(size_t i = 0; i < (size_t)width * done; ++i)
+			for(int c = 0; c < 3; ++c)
+				avg[i * 3 + c] = count[i] ? acc[i * 3 + c] / count[i] : 0;
+		if(done)
+			emit(avg.data(), accY, done);
+		// the row the next source row falls into may have started already
+		move(acc.begin() + (size_t)width * done * 3, acc.end(), acc.begin());
+		move(count.begin() + (size_t)width * done, count.end(), count.begin());
+		fill(acc.end() - (size_t)width * done * 3, acc.end(), 0);
+		fill(count.end() - (size_t)width * done, count.end(), 0);
+		accY += done;
+	}
+	storage->releaseData();
+
+	if(pfm)
+		written &= fclose(fp) == 0;
+	else
+		written = png.close();
+	if(!written)
+	{
+		fprintf(stderr, "Error on save... aborting...\n");
+		return false;
+	}
+	printf("saved with mode '%s' as '%s'.\n", type.c_str(), filename.c_str());
+	return true;
+}
+
+// Portable float map of the normalized colours, bottom row first.
+bool ViewWindow::writePFM(string filename)
+{
+	auto fp = fopen(filename.c_str(), "wb");
+	if(!fp)
+	{
+		fprintf(stderr, "Error on save... aborting...\n");
+		return false;
+	}
+	uint16_t one = 1;
+	bool little = *reinterpret_cast<uint8_t*>(&one);
+	fprintf(fp, "PF\n%d %d\n%s\n", width, height, little ? "-1.0" : "1.0");
+	bool written = true;
+	for(int y = height - 1; y >= 0; --y)
+		written &= fwrite(field + (size_t)y * width * 3, sizeof(float), (size_t)width * 3, fp) == (size_t)width * 3;
+	if(!(fclose(fp) == 0 && written))
+	{
+		fprintf(stderr, "Error on save... aborting...\n");
+		return false;
+	}
+	printf("saved with mode '%s' as '%s'.\n", type.c_str(), filename.c_str());
+	return true;
+}
+
+void ViewWindow::renderPrepare()
+{
+	if(colormap.empty())
+		setColormap();
+	if(!snapshot)
+	{
+		storage->aquireData();
+		if(level)
+			storage->buildPyramid();
+	}
+	uint32_t channels = requiredChannels(type);
+	// a frame is one block covering the whole image
+	auto forEachTile = [&](function<void(int, int, int, int, PixelColumns&)> fn){
+		if(!snapshot)
+		{
+			storage->level(level).parallelForEach(channels, fn);
+			return;
+		}
+		PixelColumns cols = snapshot->view();
+		fn(0, 0, width, height, cols);
+	};
+	int n = width * height;
+
+	// the modes only produce normalized values, coloured in one pass below
+	int comps = colormap.components;
+	vector<float> values((size_t)n * comps);
+
+	//TODO add other modes
+	if(type == "origin")
+	{
+		vector<uint64_t> keys(n);
+		vector<uint32_t> ranks;
+		for(int c = 0; c < 3; ++c)
+		{
+			forEachTile([&](int x0, int y0, int tw, int th, PixelColumns &tile){
+				if(cancelled)
+					return;
+				for(int y = 0; y < th; ++y)
+				{
+					for(int x = 0; x < tw; ++x)
+					{
+						int local = x + y * tw;
+						double v;
+						if(c == 0)
+							v = tile.realOrig[local] + storage->complexWidth * tile.hits[local] / 2;
+						else if(c == 1)
+							v = tile.imagOrig[local] + storage->complexHeight * tile.hits[local] / 2;
+						else
+							v = (-tile.realOrig[local]) + storage->complexWidth * tile.hits[local] / 2;
+						keys[(x0 + x) + (y0 + y) * width] = doubleKey(v);
+					}
+				}
+			});
+			rankKeys(keys, ranks);
+			parallelRows(height, [&](int y){
+				if(cancelled)
+					return;
+				for(int index = y * width; index < (y + 1) * width; ++index)
+					values[index * 3 + c] = ranks[index] / (double)n;
+			});
+		}
+	}
+	else if(type == "direction")
+	{
+		auto &ranks = hitsRankTable;
+		hitsRanks(ranks, level);
+		forEachTile([&](int x0, int y0, int tw, int th, PixelColumns &tile){
+			if(cancelled)
+				return;
+			for(int y = y0; y < y0 + th; ++y)
+			{
+				for(int x = x0; x < x0 + tw; ++x)
+				{
+					int index = x + y * width;
+					int local = (x - x0) + (y - y0) * tw;
+					values[index * 2] = directionHue(x, y, width, height, tile.hits[local], tile.realOrig[local], tile.imagOrig[local]);
+					values[index * 2 + 1] = ranks.rank(tile.hits[local]) / (double)n;
+				}
+			}
+		});
+	}
+	else if(type == "fractal")
+	{
+		// pixels without start hits sort behind every real value and are
+		// not counted
+		vector<uint64_t> keys(n);
+		vector<uint32_t> ranks;
+		atomic<int> count(0);
+		forEachTile([&](int x0, int y0, int tw, int th, PixelColumns &tile){
+			if(cancelled)
+				return;
+			int c = 0;
+			for(int y = 0; y < th; ++y)
+			{
+				for(int x = 0; x < tw; ++x)
+				{
+					int local = x + y * tw;
+					uint64_t &key = keys[(x0 + x) + (y0 + y) * width];
+					if(tile.startHits[local])
+					{
+						key = doubleKey(tile.startSteps[local] / (double)tile.startHits[local]);
+						++c;
+					}
+					else
+						key = UINT64_MAX;
+				}
+			}
+			count += c;
+		});
+		rankKeys(keys, ranks);
+		parallelRows(height, [&](int y){
+			if(cancelled)
+				return;
+			for(int index = y * width; index < (y + 1) * width; ++index)
+				values[index] = keys[index] == UINT64_MAX ? -1 : ranks[index] / (double)count;
+		});
+	}
+
+	else
+	{ //FALLBACK: hits
+		auto &ranks = hitsRankTable;
+		hitsRanks(ranks, level);
+		forEachTile([&](int x0, int y0, int tw, int th, PixelColumns &tile){
+			if(cancelled)
+				return;
+			for(int y = 0; y < th; ++y)
+				for(int x = 0; x < tw; ++x)
+					values[(x0 + x) + (y0 + y) * width] = ranks.rank(tile.hits[x + y * tw]) / (double)n;
+		});
+	}
+
+	parallelChunks(n, [&](int, size_t begin, size_t end){
+		if(!cancelled)
+			colormap.apply(&values[begin * comps], end - begin, pixels + begin, field ? field + begin * 3 : nullptr);
+	});
+
+	if(snapshot)
+		return;
+	liveVersion.assign(storage->data.tileCount(), 0);
+	storage->releaseData();
+	if(!cancelled)
+		lastRendered = storage->computedSteps;
+}
+
+// Hue of the direction from the mean origin of the samples to pixel x, y of
+// a w x h level.
+float ViewWindow::directionHue(int x, int y, int w, int h, uint64_t hits, double realOrig, double imagOrig)
+{
+	complex<double> c(storage->centerReal + x*storage->complexWidth/w-storage->complexWidth/2, storage->centerImag + y*storage->complexHeight/h-storage->complexHeight/2);
+	complex<double> orig(realOrig / hits, imagOrig / hits);
+	complex<double> dir = c - orig;
+	return (arg(dir)+PI)/(2*PI);
+}
+
+// Ranks of the hits of pyramid level k, taken from the summary the dataset
+// keeps up to date instead of sorting them. A frame counts its own.
+void ViewWindow::hitsRanks(RankTable &ranks, int k)
+{
+	if(snapshot)
+	{
+		ValueHistogram hist;
+		for(auto h : snapshot->columns[HITS])
+			hist.add(h);
+		ranks.build(hist);
+		return;
+	}
+	storage->buildSummary();
+	storage->pyramidMtx.lock();
+	ranks.build(storage->hitsSummary[k]);
+	storage->pyramidMtx.unlock();
+}
+
+// Adds the samples of the running step to the tiles that got new ones since
+// the last call and re-uploads only those. The ranks of the last full render
+// are reused, with the values scaled back by the progress of the step, as a
+// step roughly doubles every count. Only modes ranked on hits can do this;
+// the others refresh once per step.
+void ViewWindow::renderLive()
+{
+	lastLive = SDL_GetTicks();
+
+	storage->aquireData();
+	auto &data = storage->level(level);
+	uint32_t channels = requiredChannels(type);
+	double scale = 1 / (1 + storage->pendingProgress);
+	double n = width * height;
+	PixelBlock block, half;
+	for(int t = 0; t < (int)liveVersion.size(); ++t)
+	{
+		if(!storage->pendingTile(t, channels, block, liveVersion[t]))
+			continue;
+		// with at most 8 levels a data tile maps onto whole pixels of one
+		// level tile
+		for(int k = 0; k < level; ++k)
+		{
+			halveBlock(block, half);
+			swap(block, half);
+		}
+
+		int lt = data.tileAt(block.x0, block.y0);
+		int x0, y0, tw, th;
+		data.tileRect(lt, x0, y0, tw, th);
+		PixelColumns tile = data.pin(lt, channels);
+		int xe = min(block.x0 + block.w, x0 + tw), ye = min(block.y0 + block.h, y0 + th);
+		for(int y = block.y0; y < ye; ++y)
+		{
+			for(int x = block.x0; x < xe; ++x)
+			{
+				int local = (x - x0) + (y - y0) * tw;
+				int b = (x - block.x0) + (y - block.y0) * block.w;
+				uint64_t h = tile.hits[local] + block.columns[HITS][b];
+				float v[2], rgb[3];
+				v[0] = v[1] = hitsRankTable.rank(h * scale) / n;
+				if(type == "direction")
+				{
+					double re = tile.realOrig[local] + reinterpret_cast<double&>(block.columns[REALORIG][b]);
+					double im = tile.imagOrig[local] + reinterpret_cast<double&>(block.columns[IMAGORIG][b]);
+					v[0] = directionHue(x, y, width, height, h, re, im);
+				}
+				colormap.map(v, rgb);
+				setPixel(x + y * width, rgb);
+			}
+		}
+		data.unpin(lt);
+
+		dirtyRects.push_back({block.x0, block.y0, xe - block.x0, ye - block.y0});
+	}
+	storage->releaseData();
+}
+
+bool ViewWindow::liveDue()
+{
+	return (type == "hits" || type == "direction") && storage->pending && lastRendered >= 0 && SDL_GetTicks() - lastLive >= LIVEINTERVAL;
+}
+
+void ViewWindow::upload()
+{
+	if(fullDirty)
+		SDL_UpdateTexture(texture, 0, pixels, width * sizeof(Uint32));
+	else
+		for(auto &r : dirtyRects)
+			SDL_UpdateTexture(texture, &r, pixels + r.x + r.y * width, width * sizeof(Uint32));
+	fullDirty = false;
+	dirtyRects.clear();
+}
+
+// Draws the overview scaled to the zoom, and over it the detail tiles that
+// are already rendered. Stale tiles are still shown until replaced.
+void ViewWindow::present()
+{
+	++frame;
+	auto sx = [&](double x){ return (int)floor((x - viewX) / zoom); };
+	auto sy = [&](double y){ return (int)floor((y - viewY) / zoom); };
+
+	SDL_RenderClear(renderer);
+	SDL_Rect dst = {sx(0), sy(0), 0, 0};
+	dst.w = sx((double)width * (1 << level)) - dst.x;
+	dst.h = sy((double)height * (1 << level)) - dst.y;
+	SDL_RenderCopy(renderer, texture, 0, &dst);
 
-	double r = 0, g = 0, b = 0;
-	switch((int)hs)
+	int k = detailLevel();
+	if(k < level)
 	{
-		case 0: tie(r,g,b) = make_tuple(c,x,0); break;
-		case 1: tie(r,g,b) = make_tuple(x,c,0); break;
-		case 2: tie(r,g,b) = make_tuple(0,c,x); break;
-		case 3: tie(r,g,b) = make_tuple(0,x,c); break;
-		case 4: tie(r,g,b) = make_tuple(x,0,c); break;
-		case 5: tie(r,g,b) = make_tuple(c,0,x); break;
+		double size = (double)TILESIZE * (1 << k);
+		int tx0 = max(0., viewX / size), ty0 = max(0., viewY / size);
+		int tx1 = (viewX + width * zoom) / size, ty1 = (viewY + height * zoom) / size;
+		int lw = storage->levelWidth(k), lh = storage->levelHeight(k);
+		for(int ty = ty0; ty <= ty1 && ty * TILESIZE < lh; ++ty)
+		{
+			for(int tx = tx0; tx <= tx1 && tx * TILESIZE < lw; ++tx)
+			{
+				auto it = tiles.find((uint64_t)k << 48 | (uint64_t)ty << 24 | tx);
+				if(it == tiles.end())
+					continue;
+				int tw = min(TILESIZE, lw - tx * TILESIZE), th = min(TILESIZE, lh - ty * TILESIZE);
+				dst.x = sx(tx * size);
+				dst.y = sy(ty * size);
+				dst.w = sx((tx * TILESIZE + tw) * (double)(1 << k)) - dst.x;
+				dst.h = sy((ty * TILESIZE + th) * (double)(1 << k)) - dst.y;
+				SDL_RenderCopy(renderer, it->second.texture, 0, &dst);
+				it->second.lastUse = frame;
+			}
+		}
 	}
+	SDL_RenderPresent(renderer);
+}
 
-	double m = l - 0.5 * c;
-	r = clamp(r+m, 0., 1.);
-	g = clamp(g+m, 0., 1.);
-	b = clamp(b+m, 0., 1.);
+// Wheel zooms around the mouse, dragging with the left button pans.
+// Returns whether the view changed.
+bool ViewWindow::handleInput(const SDL_Event &event)
+{
+	if(event.type == SDL_MOUSEMOTION)
+	{
+		mouseX = event.motion.x;
+		mouseY = event.motion.y;
+		if(!dragging)
+			return false;
+		viewX -= event.motion.xrel * zoom;
+		viewY -= event.motion.yrel * zoom;
+	}
+	else if(event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP)
+	{
+		if(event.button.button == SDL_BUTTON_LEFT)
+			dragging = event.type == SDL_MOUSEBUTTONDOWN;
+		return false;
+	}
+	else if(event.type == SDL_MOUSEWHEEL)
+	{
+		double x = viewX + mouseX * zoom, y = viewY + mouseY * zoom;
+		zoom = clamp(zoom * pow(2, -event.wheel.y / 4.), MINZOOM, (double)(1 << level));
+		viewX = x - mouseX * zoom;
+		viewY = y - mouseY * zoom;
+	}
+	else
+		return false;
+	clampView();
+	return true;
+}
 
-	return 0xFF000000 | ((int)(r * 255) << 16) | ((int)(g * 255) << 8) | ((int)(b * 255));
+void ViewWindow::clampView()
+{
+	viewX = clamp(viewX, 0., max(0., (double)width * (1 << level) - width * zoom));
+	viewY = clamp(viewY, 0., max(0., (double)height * (1 << level) - height * zoom));
 }
 
-ViewWindow::ViewWindow(StorageElement*elem, string t)
+// The finest level that is not magnified by more than a factor of two;
+// equal to the overview level when the overview is enough.
+int ViewWindow::detailLevel()
 {
-	storage = elem;
-	type = t;
+	int k = 0;
+	while(k < level && (2 << k) <= zoom)
+		++k;
+	return k;
 }
 
-ViewWindow::~ViewWindow()
+// Visible detail tiles that are missing or from an older step, nearest to
+// the centre of the window first.
+void ViewWindow::missingTiles(vector<uint64_t> &keys)
 {
-	if(texture)
+	keys.clear();
+	int k = detailLevel();
+	if(k == level)
+		return;
+	double size = (double)TILESIZE * (1 << k);
+	int tx0 = max(0., viewX / size), ty0 = max(0., viewY / size);
+	int tx1 = (viewX + width * zoom) / size, ty1 = (viewY + height * zoom) / size;
+	int lw = storage->levelWidth(k), lh = storage->levelHeight(k);
+	double cx = (viewX + width * zoom / 2) / size - 0.5, cy = (viewY + height * zoom / 2) / size - 0.5;
+	vector<pair<double, uint64_t>> found;
+	for(int ty = ty0; ty <= ty1 && ty * TILESIZE < lh; ++ty)
 	{
-		SDL_DestroyTexture(texture);
-		texture = 0;
+		for(int tx = tx0; tx <= tx1 && tx * TILESIZE < lw; ++tx)
+		{
+			uint64_t key = (uint64_t)k << 48 | (uint64_t)ty << 24 | tx;
+			auto it = tiles.find(key);
+			if(it == tiles.end() || it->second.step != storage->computedSteps)
+				found.push_back({(tx - cx) * (tx - cx) + (ty - cy) * (ty - cy), key});
+		}
 	}
-	if(renderer)
-	{
-		SDL_DestroyRenderer(renderer);
-		renderer = 0;
-	}	
-	if(window)
+	sort(found.begin(), found.end());
+	for(auto &f : found)
+		keys.push_back(f.second);
+}
+
+// Builds the tables of level k for the current step. Runs on a prepare
+// worker, which has the data acquired.
+LevelTables &ViewWindow::tablesFor(int k)
+{
+	auto &tables = levelTables[k];
+	if(tables.step == storage->computedSteps)
+		return tables;
+	tables.step = storage->computedSteps;
+	for(auto it = levelTables.begin(); it != levelTables.end();)
+		it = it->first == k ? next(it) : levelTables.erase(it);
+
+	int count = storage->level(k).tileCount(), stride = (count + SAMPLETILES - 1) / SAMPLETILES;
+	buildTables(k, tables, stride, max(1, (count / stride) * TILESIZE * TILESIZE / SAMPLEKEYS));
+	return tables;
+}
+
+// Ranks hits from the summary; origin and fractal sample the keys of every
+// every-th pixel of every tileStride-th tile of level k.
+void ViewWindow::buildTables(int k, LevelTables &tables, int tileStride, int every)
+{
+	if(type == "hits" || type == "direction")
 	{
-		SDL_DestroyWindow(window);
-		window = 0;
+		hitsRanks(tables.hits, k);
+		return;
 	}
-	if(pixels)
+
+	auto &data = storage->level(k);
+	uint32_t channels = requiredChannels(type);
+	int count = data.tileCount();
+	for(auto &keys : tables.keys)
+		keys.clear();
+	for(int t = 0; t < count; t += tileStride)
 	{
-		delete[] pixels;
-		pixels = 0;
+		int x0, y0, tw, th;
+		data.tileRect(t, x0, y0, tw, th);
+		PixelColumns tile = data.pin(t, channels);
+		for(int i = 0; i < tw * th; i += every)
+		{
+			if(type == "origin")
+			{
+				tables.keys[0].push_back(doubleKey(tile.realOrig[i] + storage->complexWidth * tile.hits[i] / 2));
+				tables.keys[1].push_back(doubleKey(tile.imagOrig[i] + storage->complexHeight * tile.hits[i] / 2));
+				tables.keys[2].push_back(doubleKey((-tile.realOrig[i]) + storage->complexWidth * tile.hits[i] / 2));
+			}
+			else if(tile.startHits[i])
+				tables.keys[0].push_back(doubleKey(tile.startSteps[i] / (double)tile.startHits[i]));
+		}
+		data.unpin(t);
 	}
+	for(auto &keys : tables.keys)
+		sort(keys.begin(), keys.end());
 }
 
-void ViewWindow::create()
+static double sampledRank(const vector<uint64_t> &keys, uint64_t key)
 {
-	SDL_CreateWindowAndRenderer(storage->width, storage->height, SDL_WINDOW_SHOWN, &window, &renderer);
+	return (lower_bound(keys.begin(), keys.end(), key) - keys.begin()) / (double)max<size_t>(keys.size(), 1);
+}
 
-	char buffer[512];
-	sprintf(buffer, "%s | %dx%d | s: %d | d: %d | cw: %lf | ch: %lf", storage->formula.c_str(), storage->width, storage->height, storage->steps, storage->divergenceThreshold, storage->complexWidth, storage->complexHeight);
-	SDL_SetWindowTitle(window, buffer);
+// Colours tile t of level k the way renderPrepare colours a whole level,
+// into rgb with three floats per pixel of the tile.
+void ViewWindow::colourTile(int k, int t, const LevelTables &tables, float *rgb)
+{
+	auto &data = storage->level(k);
+	uint32_t channels = requiredChannels(type);
+	int x0, y0, tw, th;
+	data.tileRect(t, x0, y0, tw, th);
+	int lw = storage->levelWidth(k), lh = storage->levelHeight(k);
+	double n = (double)lw * lh;
+
+	PixelColumns tile = data.pin(t, channels);
+	for(int y = 0; y < th; ++y)
+	{
+		for(int x = 0; x < tw; ++x)
+		{
+			int local = x + y * tw;
+			float v[3];
+			if(type == "origin")
+			{
+				v[0] = sampledRank(tables.keys[0], doubleKey(tile.realOrig[local] + storage->complexWidth * tile.hits[local] / 2));
+				v[1] = sampledRank(tables.keys[1], doubleKey(tile.imagOrig[local] + storage->complexHeight * tile.hits[local] / 2));
+				v[2] = sampledRank(tables.keys[2], doubleKey((-tile.realOrig[local]) + storage->complexWidth * tile.hits[local] / 2));
+			}
+			else if(type == "fractal")
+				v[0] = tile.startHits[local] ? sampledRank(tables.keys[0], doubleKey(tile.startSteps[local] / (double)tile.startHits[local])) : -1;
+			else if(type == "direction")
+			{
+				v[0] = directionHue(x0 + x, y0 + y, lw, lh, tile.hits[local], tile.realOrig[local], tile.imagOrig[local]);
+				v[1] = tables.hits.rank(tile.hits[local]) / n;
+			}
+			else
+				v[0] = tables.hits.rank(tile.hits[local]) / n;
+			colormap.map(v, rgb + local * 3);
+		}
+	}
+	data.unpin(t);
+}
 
-	pixels = new Uint32[storage->width * storage->height];
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, storage->width, storage->height);
+void ViewWindow::renderTile(int k, int tx, int ty, LevelTables &tables, RenderedTile &out)
+{
+	auto &data = storage->level(k);
+	int t = data.tileAt(tx * TILESIZE, ty * TILESIZE);
+	int x0, y0;
+	data.tileRect(t, x0, y0, out.w, out.h);
+	vector<float> rgb(out.w * out.h * 3);
+	colourTile(k, t, tables, rgb.data());
+	out.pixels.resize(out.w * out.h);
+	for(int i = 0; i < out.w * out.h; ++i)
+		out.pixels[i] = Colormap::argb(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+}
 
-	renderPrepare();
-	SDL_UpdateTexture(texture, 0, pixels, storage->width * sizeof(Uint32));
+void ViewWindow::renderTiles()
+{
+	storage->aquireData();
+	storage->buildPyramid();
+	int step = storage->computedSteps;
+	for(auto key : tileRequests)
+	{
+		if(cancelled)
+			break;
+		int k = key >> 48, ty = (key >> 24) & 0xFFFFFF, tx = key & 0xFFFFFF;
+		RenderedTile r;
+		r.key = key;
+		r.step = step;
+		renderTile(k, tx, ty, tablesFor(k), r);
+		tileResults.push_back(move(r));
+	}
+	storage->releaseData();
 }
 
-void ViewWindow::createToFile(string filename)
+// Uploads finished tiles into their textures and evicts the least recently
+// drawn ones beyond VIEWTILES.
+void ViewWindow::uploadTiles()
 {
-	pixels = new Uint32[storage->width * storage->height];
-	renderPrepare();
+	for(auto &r : tileResults)
+	{
+		auto &t = tiles[r.key];
+		if(!t.texture)
+			t.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, r.w, r.h);
+		SDL_UpdateTexture(t.texture, 0, r.pixels.data(), r.w * sizeof(Uint32));
+		t.step = r.step;
+		t.lastUse = frame;
+	}
+	tileResults.clear();
 
-	auto fp = fopen(filename.c_str(), "wb");
-	auto png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
-	auto info_ptr = png_create_info_struct(png_ptr);
-	if(setjmp(png_jmpbuf(png_ptr)))
+	while((int)tiles.size() > VIEWTILES)
 	{
-		fprintf(stderr, "Error on save... aborting...\n");
-		png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-		png_destroy_write_struct(&png_ptr, (png_infopp)0);
-		fclose(fp);
-		return;
+		auto oldest = tiles.begin();
+		for(auto it = tiles.begin(); it != tiles.end(); ++it)
+			if(it->second.lastUse < oldest->second.lastUse)
+				oldest = it;
+		SDL_DestroyTexture(oldest->second.texture);
+		tiles.erase(oldest);
 	}
-	png_init_io(png_ptr, fp);
-	png_set_IHDR(png_ptr, info_ptr, storage->width, storage->height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+}
 
+void BatchRenderer::run()
+{
+	int threads = min<int>(RENDERWORKERS, datasets.size());
+	vector<thread> pool;
+	for(int i = 0; i < threads; ++i)
+		pool.emplace_back(&BatchRenderer::worker, this);
+	thread enc(&BatchRenderer::encoder, this);
 
-	char buffer[512];
+	for(auto &t : pool)
+		t.join();
+	mtx.lock();
+	rendering = -1;
+	cv.notify_all();
+	mtx.unlock();
+	enc.join();
+}
 
-	png_text text;
-	text.compression = PNG_TEXT_COMPRESSION_NONE;
-	text.key = (png_charp)"Title";
-	sprintf(buffer, "%s (%s)", storage->formula.c_str(), type.c_str());
-	text.text = buffer;
-	png_set_text(png_ptr, info_ptr, &text, 1);
+// Pixel buffers of all modes, the ranking scratch of one mode and the tiles
+// the data cache may keep resident.
+size_t BatchRenderer::estimateMemory(StorageElement *s, int modes)
+{
+	size_t n = (size_t)s->width * s->height;
+	size_t tiles = n * sizeof(uint64_t) * __builtin_popcount(s->channels);
+	return n * (modes * sizeof(Uint32) + 48) + min(tiles, (size_t)TILEMEMORY);
+}
 
-	text.key = (png_charp)"Description";
-	sprintf(buffer, "Formula: %s\n"
-			"Resolution: %dx%d\n"
-			"Steps: %d\n"
-			"Skip: %d\n"
-			"Divergence Threshold: %d\n"
-			"Complex Plane: (%lf - %lf) x (%lf - %lf)\n"
-			"Rendertype: %s\n"
-			"Computed Steps: %d",
-			storage->formula.c_str(),
-			storage->width, storage->height,
-			storage->steps,
-			storage->skipPoints,
-			storage->divergenceThreshold,
-			storage->complexWidth / -2, storage->complexWidth / 2, storage->complexHeight / -2, storage->complexHeight / 2,
-			type.c_str(),
-			storage->computedSteps);
-	text.text = buffer;
-	png_set_text(png_ptr, info_ptr, &text, 1);
-
-	text.key = (png_charp)"Source";
-	text.text = (png_charp)"MandelBuddhaManager by Jujuedv";
-	png_set_text(png_ptr, info_ptr, &text, 1);
-
-	png_write_info(png_ptr, info_ptr);
-	auto row = (png_bytep) malloc(3 * storage->width * sizeof(png_byte));
-	for(int y = 0; y < storage->height; ++y)
-	{
-		for(int x = 0; x < storage->width; ++x)
-		{
-			row[x*3] = (pixels[x+y*storage->width] >> 16) & 0xFF;
-			row[x*3+1] = (pixels[x+y*storage->width] >> 8) & 0xFF;
-			row[x*3+2] = (pixels[x+y*storage->width] >> 0) & 0xFF;
-		}	
-		png_write_row(png_ptr, row);
-	}
-	png_write_end(png_ptr, 0);
-	
-	png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-	png_destroy_write_struct(&png_ptr, (png_infopp)0);
-	fclose(fp);
-	free(row);
-	printf("saved with mode '%s' as '%s'.\n", type.c_str(), filename.c_str());
+// Waits until the bytes fit into the budget; a dataset larger than the whole
+// budget still runs, but alone.
+void BatchRenderer::reserveMemory(size_t bytes)
+{
+	unique_lock<mutex> lock(mtx);
+	cv.wait(lock, [&]{ return !memoryUsed || memoryUsed + bytes <= RENDERMEMORY; });
+	memoryUsed += bytes;
 }
 
-void ViewWindow::renderPrepare()
+void BatchRenderer::releaseMemory(size_t bytes)
 {
-	storage->aquireData();
-	vector<PixelData> data = storage->data;
-	memset(pixels, 0, sizeof(Uint32) * storage->width * storage->height);
+	lock_guard<mutex> lock(mtx);
+	memoryUsed -= bytes;
+	cv.notify_all();
+}
 
-	//TODO add other modes
-	if(type == "origin")
+void BatchRenderer::worker()
+{
+	while(true)
 	{
-		vector<double> rV, gV, bV;
-		for(int i = 0; i < storage->width * storage->height; ++i)
+		mtx.lock();
+		if(nextDataset >= (int)datasets.size())
+		{
+			mtx.unlock();
+			return;
+		}
+		int index = nextDataset++;
+		++rendering;
+		mtx.unlock();
+
+		auto s = datasets[index];
+		vector<int> modes;
+		for(int t = 0; t < (int)types.size(); ++t)
 		{
-			rV.push_back(data[i].realOrig + storage->complexWidth * data[i].hits / 2);
-			gV.push_back(data[i].imagOrig + storage->complexHeight * data[i].hits / 2);
-			bV.push_back((-data[i].realOrig) + storage->complexWidth * data[i].hits / 2);
+			// modes the profile can not render keep their number
+			if(skipUnsupported && (ViewWindow::requiredChannels(types[t]) & ~s->channels))
+				continue;
+			if(ViewWindow::checkChannels(s, types[t]))
+				modes.push_back(t);
 		}
-		sort(rV.begin(), rV.end());
-		sort(gV.begin(), gV.end());
-		sort(bV.begin(), bV.end());
-		for(int x = 0; x < storage->width; ++x)
+
+		// outputs the cache already has are kept
+		if(cache)
 		{
-			for(int y = 0; y < storage->height; ++y)
+			vector<int> stale;
+			for(int t : modes)
+				if(!cache->lookup(outputName(index, t), ViewWindow(s, types[t]).cacheKey()))
+					stale.push_back(t);
+			modes.swap(stale);
+			if(modes.empty())
 			{
-				auto d = data[x + y * storage->width];
-				double r = distance(rV.begin(), lower_bound(rV.begin(), rV.end(), d.realOrig + storage->complexWidth * d.hits / 2)) / (double)rV.size();
-				double g = distance(gV.begin(), lower_bound(gV.begin(), gV.end(), d.imagOrig + storage->complexHeight * d.hits / 2)) / (double)gV.size();
-				double b = distance(bV.begin(), lower_bound(bV.begin(), bV.end(), (-d.realOrig) + storage->complexWidth * d.hits / 2)) / (double)bV.size();
-				r = pow(r, 10);
-				g = pow(g, 10);
-				b = pow(b, 10);
-
-				pixels[x + y * storage->width] = 0xFF000000 | ((int)(r * 255) << 16) | ((int)(g * 255) << 8) | ((int)(b * 255));
+				mtx.lock();
+				--rendering;
+				cv.notify_all();
+				mtx.unlock();
+				continue;
 			}
 		}
 
+		size_t pixelBytes = (size_t)s->width * s->height * sizeof(Uint32);
+		size_t memory = estimateMemory(s, modes.size());
+		reserveMemory(memory);
+
+		printf("%s %dx%d %d %d %d %lf %lf -> %d ... \n",
+				s->formula.c_str(),
+				s->width,
+				s->height,
+				s->steps,
+				s->divergenceThreshold,
+				s->skipPoints,
+				s->complexWidth,
+				s->complexHeight,
+				s->computedSteps);
+
+		s->aquireData();
+		for(int t : modes)
+		{
+			auto vw = new ViewWindow(s, types[t]);
+			vw->chooseLevel();
+			vw->pixels = new Uint32[vw->width * vw->height];
+			vw->renderPrepare();
+
+			mtx.lock();
+			encodeQueue.emplace_back(vw, outputName(index, t));
+			cv.notify_all();
+			mtx.unlock();
+		}
+		s->releaseData();
+
+		// the pixel buffers are given back by the encoder
+		releaseMemory(memory - pixelBytes * modes.size());
+
+		mtx.lock();
+		--rendering;
+		cv.notify_all();
+		mtx.unlock();
 	}
-	else if(type == "direction")
+}
+
+string BatchRenderer::outputName(int dataset, int type)
+{
+	return folder + "/"s + to_string(dataset * types.size() + type) + ".png"s;
+}
+
+void BatchRenderer::encoder()
+{
+	unique_lock<mutex> lock(mtx);
+	while(true)
 	{
-		vector<uint64_t> vals;
-		for(int i = 0; i < storage->width * storage->height; ++i)
-			vals.push_back(data[i].hits);
-		sort(vals.begin(), vals.end());
-		for(int x = 0; x < storage->width; ++x)
-		{
-			for(int y = 0; y < storage->height; ++y)
-			{
-				int index = x + y * storage->width;
-				auto d = data[index];
-				uint64_t h = d.hits;
-				int i = distance(vals.begin(), lower_bound(vals.begin(), vals.end(), h));
-				double rel = i / (double)vals.size();
-				rel = pow(rel, 10);
+		cv.wait(lock, [&]{ return !encodeQueue.empty() || rendering < 0; });
+		if(encodeQueue.empty())
+			return;
+		auto job = encodeQueue.front();
+		encodeQueue.pop_front();
+		lock.unlock();
 
-				complex<double> c(x*storage->complexWidth/storage->width-storage->complexWidth/2, y*storage->complexHeight/storage->height-storage->complexHeight/2);
-				complex<double> orig(d.realOrig / h, d.imagOrig / h);
-				complex<double> last(d.realLast / h, d.imagLast / h);
+		size_t pixelBytes = (size_t)job.first->width * job.first->height * sizeof(Uint32);
+		if(job.first->writePNG(job.second) && cache)
+			cache->record(job.second, job.first->cacheKey());
+		delete job.first;
+		releaseMemory(pixelBytes);
 
-				complex<double> dir = c - orig;
+		lock.lock();
+		++written;
+		printf("\033]0;%d images created...\007", written);
+		fflush(stdout);
+	}
+}
 
-				
-				pixels[index] = createHSLColor((arg(dir)+PI)/(2*PI), 1, rel);
-			}
-		}
+void RenderCache::load()
+{
+	FILE *fp = fopen(filename.c_str(), "r");
+	if(!fp)
+		return;
+	char line[4096];
+	while(fgets(line, sizeof(line), fp))
+	{
+		// path, size and key, separated by tabs
+		char *size = strchr(line, '\t');
+		char *key = size ? strchr(size + 1, '\t') : nullptr;
+		if(!key)
+			continue;
+		*size++ = *key++ = 0;
+		key[strcspn(key, "\n")] = 0;
+		outputs[line] = {key, atoll(size)};
 	}
-	else if(type == "fractal")
+	fclose(fp);
+}
+
+void RenderCache::save()
+{
+	lock_guard<mutex> lock(mtx);
+	string temp = filename + ".new";
+	FILE *fp = fopen(temp.c_str(), "w");
+	if(!fp)
 	{
-		vector<double> steps;
-		for(int i = 0; i < storage->width * storage->height; ++i)
-		{
-			if(data[i].startHits)
-				steps.push_back(data[i].startSteps/(double)data[i].startHits);
-		}
-		sort(steps.begin(), steps.end());
-		for(int x = 0; x < storage->width; ++x)
-		{
-			for(int y = 0; y < storage->height; ++y)
-			{
-				int index = x + y * storage->width;
-				auto d = data[index];
-				if(!d.startHits)
-				{
-					pixels[index] = 0xFF000000;
-					continue;
-				}
+		fprintf(stderr, "could not write the render cache '%s'\n", temp.c_str());
+		return;
+	}
+	for(auto &o : outputs)
+		fprintf(fp, "%s\t%lld\t%s\n", o.first.c_str(), o.second.size, o.second.key.c_str());
+	fclose(fp);
+	rename(temp.c_str(), filename.c_str());
+}
+
+// True if path holds the image for key, either still or after linking
+// another output of the same key and format to it. Otherwise the caller
+// writes it.
+bool RenderCache::lookup(const string &path, const string &key)
+{
+	lock_guard<mutex> lock(mtx);
+	struct stat st;
+	auto it = outputs.find(path);
+	if(it != outputs.end() && it->second.key == key && !stat(path.c_str(), &st) && st.st_size == it->second.size)
+	{
+		++hits;
+		return true;
+	}
+	for(auto &o : outputs)
+	{
+		if(o.second.key != key || o.first == path || isPFM(o.first) != isPFM(path) || stat(o.first.c_str(), &st) || st.st_size != o.second.size)
+			continue;
+		unlink(path.c_str());
+		if(link(o.first.c_str(), path.c_str()))
+			break;
+		outputs[path] = o.second;
+		++hits;
+		++linked;
+		return true;
+	}
+	// the stale file may be linked to other outputs, which must keep theirs
+	if(it != outputs.end())
+	{
+		unlink(path.c_str());
+		outputs.erase(it);
+	}
+	++misses;
+	return false;
+}
 
-				int i = distance(steps.begin(), lower_bound(steps.begin(), steps.end(), d.startSteps / (double)d.startHits));
+void RenderCache::record(const string &path, const string &key)
+{
+	lock_guard<mutex> lock(mtx);
+	struct stat st;
+	if(stat(path.c_str(), &st))
+		outputs.erase(path);
+	else
+		outputs[path] = {key, (long long)st.st_size};
+}
 
-				pixels[index] = createHSLColor(clamp(i / (double)steps.size(), 0., 0.999999999), 1, 0.5);
-			}
+void RenderCache::report()
+{
+	lock_guard<mutex> lock(mtx);
+	printf("render cache: %d up to date (%d linked), %d rendered\n", hits, linked, misses);
+	hits = linked = misses = 0;
+}
+
+bool FrameOptions::parse(const string &option)
+{
+	auto eq = option.find('=');
+	if(eq == string::npos)
+		return false;
+	string key = option.substr(0, eq), val = option.substr(eq + 1);
+	if(key == "frames" && val.size())
+		path = val;
+	else if(key == "frametype" && val.size())
+		type = val;
+	else if(key == "every" && val.size() && all_of(val.begin(), val.end(), ::isdigit))
+		every = stoi(val);
+	else
+		return false;
+	return true;
+}
+
+bool FrameRecorder::start(StorageElement *s, const FrameOptions &opt)
+{
+	options = opt;
+	storage = s;
+	if(!ViewWindow::checkChannels(s, opt.type))
+		return false;
+	channels = ViewWindow::requiredChannels(opt.type);
+	while((s->width >> level) > FRAMEWIDTH || (s->height >> level) > FRAMEHEIGHT)
+		++level;
+	width = s->levelWidth(level);
+	height = s->levelHeight(level);
+
+	y4m = opt.path.size() > 4 && opt.path.substr(opt.path.size() - 4) == ".y4m";
+	if(y4m)
+	{
+		video = fopen(opt.path.c_str(), "wb");
+		if(!video)
+		{
+			fprintf(stderr, "could not create '%s'\n", opt.path.c_str());
+			return false;
 		}
+		fprintf(video, "YUV4MPEG2 W%d H%d F25:1 Ip A1:1 C444\n", width, height);
+	}
+	else if(mkdir(opt.path.c_str(), 0777) && errno != EEXIST)
+	{
+		fprintf(stderr, "could not create folder '%s'\n", opt.path.c_str());
+		return false;
 	}
+	printf("recording %dx%d frames of mode '%s' to '%s'\n", width, height, opt.type.c_str(), opt.path.c_str());
+	// the frames are read from the pyramid level, built once here
+	s->aquireData();
+	if(level)
+		s->buildPyramid();
+	encoder = thread(&FrameRecorder::encode, this);
+	return true;
+}
 
-	else
-	{ //FALLBACK: hits
-		uint64_t total = 0;
-		vector<uint64_t> vals;
-		for(int i = 0; i < storage->width * storage->height; ++i)
+// Asks the recorder's thread for a frame; the caller never waits for it.
+void FrameRecorder::capture(bool running)
+{
+	lock_guard<mutex> lock(mtx);
+	if(queue.size() >= FRAMEQUEUE)
+	{
+		++dropped;
+		return;
+	}
+	queue.push_back(running);
+	cv.notify_all();
+}
+
+// Copies the frame's pyramid level and, if running, sums the running step
+// down onto it. The step's tiles are copied one at a time and left out
+// while the calculator is merging, so it is never held up.
+void FrameRecorder::build(PixelBlock &frame, bool running)
+{
+	frame.w = width;
+	frame.h = height;
+	for(int c = 0; c < CHANNELCOUNT; ++c)
+		if(channels & (1u << c))
+			frame.columns[c].assign((size_t)width * height, 0);
+
+	auto &data = storage->level(level);
+	for(int t = 0; t < data.tileCount(); ++t)
+	{
+		int x0, y0, tw, th;
+		data.tileRect(t, x0, y0, tw, th);
+		PixelColumns d = data.pin(t, channels);
+		for(int c = 0; c < CHANNELCOUNT; ++c)
 		{
-			total += data[i].hits;
-			vals.push_back(data[i].hits);
+			if(!(channels & (1u << c)))
+				continue;
+			auto &out = frame.columns[c];
+			for(int y = 0; y < th; ++y)
+				for(int x = 0; x < tw; ++x)
+					out[x0 + x + (size_t)(y0 + y) * width] = c == HITS && d.hits32 ? d.hits32[x + y * tw] : d.words[c][x + y * tw];
 		}
-		sort(vals.begin(), vals.end());
-		for(int x = 0; x < storage->width; ++x)
+		data.unpin(t);
+	}
+	if(!running)
+		return;
+
+	PixelBlock step;
+	for(int t = 0; t < storage->data.tileCount(); ++t)
+	{
+		uint64_t version = UINT64_MAX;
+		if(!storage->pendingTile(t, channels, step, version))
+			continue;
+		for(int c = 0; c < CHANNELCOUNT; ++c)
 		{
-			for(int y = 0; y < storage->height; ++y)
+			if(!(channels & (1u << c)) || step.columns[c].empty())
+				continue;
+			auto &out = frame.columns[c];
+			const uint64_t *v = step.columns[c].data();
+			for(int y = 0; y < step.h; ++y)
 			{
-				uint64_t h = data[x + y * storage->width].hits;
-				int i = distance(vals.begin(), lower_bound(vals.begin(), vals.end(), h));
-				double rel = i / (double)vals.size();
-				rel = pow(rel, 10);
-
-				pixels[x + y * storage->width] = 0xFF000000 | ((int)(rel * 255) << 8);
+				for(int x = 0; x < step.w; ++x)
+				{
+					int i = x + y * step.w;
+					size_t o = ((step.x0 + x) >> level) + (size_t)((step.y0 + y) >> level) * width;
+					if(channelIsFloat(c))
+						reinterpret_cast<double*>(out.data())[o] += reinterpret_cast<const double*>(v)[i];
+					else
+						out[o] += v[i];
+				}
 			}
 		}
 	}
+}
 
+void FrameRecorder::finish()
+{
+	mtx.lock();
+	finished = true;
+	cv.notify_all();
+	mtx.unlock();
+	encoder.join();
 	storage->releaseData();
-	lastRendered = storage->computedSteps;
+	if(video)
+		fclose(video);
+	printf("recorded %d frames to '%s'", frames, options.path.c_str());
+	if(dropped)
+		printf(", dropped %d the encoder could not keep up with", dropped);
+	printf("\n");
 }
 
-void ViewWindow::render()
+void FrameRecorder::encode()
 {
-	if(lastRendered != storage->computedSteps)
+	unique_lock<mutex> lock(mtx);
+	while(true)
 	{
-		renderPrepare();
-		SDL_UpdateTexture(texture, 0, pixels, storage->width * sizeof(Uint32));
+		cv.wait(lock, [&]{ return !queue.empty() || finished; });
+		if(queue.empty())
+			return;
+		bool running = queue.front();
+		lock.unlock();
+
+		auto frame = new PixelBlock;
+		build(*frame, running);
+		ViewWindow vw(storage, options.type);
+		vw.snapshot = frame;
+		vw.level = level;
+		vw.width = width;
+		vw.height = height;
+		vw.pixels = new Uint32[width * height];
+		vw.renderPrepare();
+		write(vw.pixels);
+		delete frame;
+
+		lock.lock();
+		queue.pop_front();
 	}
+}
 
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, texture, 0, 0);
-	SDL_RenderPresent(renderer);
+// Appends a frame to the video, as full range BT.601 4:4:4, or writes the
+// next PPM image.
+void FrameRecorder::write(const Uint32 *pixels)
+{
+	size_t n = (size_t)width * height;
+	if(y4m)
+	{
+		vector<uint8_t> planes(n * 3);
+		for(size_t i = 0; i < n; ++i)
+		{
+			double r = (pixels[i] >> 16) & 0xFF, g = (pixels[i] >> 8) & 0xFF, b = pixels[i] & 0xFF;
+			planes[i] = clamp(0.299 * r + 0.587 * g + 0.114 * b + 0.5, 0., 255.);
+			planes[n + i] = clamp(128 - 0.168736 * r - 0.331264 * g + 0.5 * b + 0.5, 0., 255.);
+			planes[2 * n + i] = clamp(128 + 0.5 * r - 0.418688 * g - 0.081312 * b + 0.5, 0., 255.);
+		}
+		fprintf(video, "FRAME\n");
+		fwrite(planes.data(), 1, planes.size(), video);
+		fflush(video);
+	}
+	else
+	{
+		char filename[1024];
+		snprintf(filename, sizeof(filename), "%s/frame_%05d.ppm", options.path.c_str(), frames);
+		FILE *fp = fopen(filename, "wb");
+		if(!fp)
+		{
+			fprintf(stderr, "could not write '%s'\n", filename);
+			return;
+		}
+		vector<uint8_t> rgb(n * 3);
+		for(size_t i = 0; i < n; ++i)
+		{
+			rgb[i * 3] = (pixels[i] >> 16) & 0xFF;
+			rgb[i * 3 + 1] = (pixels[i] >> 8) & 0xFF;
+			rgb[i * 3 + 2] = pixels[i] & 0xFF;
+		}
+		fprintf(fp, "P6\n%d %d\n255\n", width, height);
+		fwrite(rgb.data(), 1, rgb.size(), fp);
+		fclose(fp);
+	}
+	++frames;
 }
 
 RenderManager::RenderManager()
 {
 	SDL_Init(SDL_INIT_EVERYTHING);
+	preparedEvent = SDL_RegisterEvents(2);
+	wakeEvent = preparedEvent + 1;
 }
 
 RenderManager::~RenderManager()
 {
+	// like the event thread, workers of windows still open at exit are
+	// left to die with the process
+	for(auto &t : workers)
+		if(t.joinable())
+			t.detach();
 	SDL_Quit();
 }
 
@@ -305,6 +1834,11 @@ void RenderManager::addWindow(ViewWindow* w)
 	}
 	newWindows.insert(w);
 	winMutex.unlock();
+
+	SDL_Event event;
+	memset(&event, 0, sizeof(event));
+	event.type = wakeEvent;
+	SDL_PushEvent(&event);
 }
 
 void RenderManager::removeWindow(ViewWindow* w)
@@ -315,10 +1849,59 @@ void RenderManager::removeWindow(ViewWindow* w)
 	winMutex.unlock();
 }
 
+// Called on the event thread; the window must not have a job already.
+void RenderManager::queuePrepare(ViewWindow* w, ViewJob job)
+{
+	w->busy = true;
+	w->job = job;
+	jobMtx.lock();
+	jobs.push_back(w);
+	jobCv.notify_one();
+	jobMtx.unlock();
+}
+
+void RenderManager::prepareWorker()
+{
+	unique_lock<mutex> lock(jobMtx);
+	while(true)
+	{
+		jobCv.wait(lock, [&]{ return workersQuit || !jobs.empty(); });
+		if(jobs.empty())
+			return;
+		auto w = jobs.front();
+		jobs.pop_front();
+		lock.unlock();
+
+		if(!w->cancelled)
+		{
+			if(w->job == LIVEJOB)
+				w->renderLive();
+			else if(w->job == TILEJOB)
+				w->renderTiles();
+			else
+			{
+				w->renderPrepare();
+				w->fullDirty = !w->cancelled;
+			}
+		}
+
+		SDL_Event event;
+		memset(&event, 0, sizeof(event));
+		event.type = preparedEvent;
+		event.user.data1 = w;
+		SDL_PushEvent(&event);
+		lock.lock();
+	}
+}
+
 void RenderManager::renderThread()
 {
+	workersQuit = false;
+	for(int i = 0; i < PREPAREWORKERS; ++i)
+		workers.emplace_back(&RenderManager::prepareWorker, this);
+
 	winMutex.lock();
-	while(windows.size() || newWindows.size())
+	while(windows.size() || newWindows.size() || closing)
 	{
 		for(auto w : newWindows)
 		{
@@ -329,36 +1912,101 @@ void RenderManager::renderThread()
 		winMutex.unlock();
 
 		vector<ViewWindow*> rem;
+		set<ViewWindow*> redraw;
 
+		// sleeps until something happens, but wakes up in time to look for
+		// new steps and live updates
 		SDL_Event event;
-		while(SDL_PollEvent(&event))
+		int got = SDL_WaitEventTimeout(&event, LIVEINTERVAL);
+		while(got)
 		{
-			switch(event.type)
+			if(event.type == preparedEvent)
+			{
+				auto w = (ViewWindow*)event.user.data1;
+				w->busy = false;
+				if(w->closed)
+				{
+					delete w;
+					--closing;
+				}
+				else if(w->tileResults.size())
+				{
+					w->uploadTiles();
+					redraw.insert(w);
+				}
+				else if(w->fullDirty || w->dirtyRects.size())
+				{
+					w->upload();
+					redraw.insert(w);
+				}
+			}
+			else if(event.type == SDL_WINDOWEVENT)
 			{
-			case SDL_WINDOWEVENT:
 				for(auto w : windows)
 				{
 					if(SDL_GetWindowID(w->window) == event.window.windowID)
 					{
 						if(event.window.event == SDL_WINDOWEVENT_CLOSE)
 							rem.push_back(w);
+						else if(event.window.event == SDL_WINDOWEVENT_EXPOSED)
+							redraw.insert(w);
 					}
 				}
-				break;
 			}
+			else if(event.type == SDL_MOUSEMOTION || event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP || event.type == SDL_MOUSEWHEEL)
+			{
+				Uint32 id = event.type == SDL_MOUSEMOTION ? event.motion.windowID : event.type == SDL_MOUSEWHEEL ? event.wheel.windowID : event.button.windowID;
+				for(auto w : windows)
+					if(SDL_GetWindowID(w->window) == id && w->handleInput(event))
+						redraw.insert(w);
+			}
+			got = SDL_PollEvent(&event);
 		}
 		for(auto w : rem)
 		{
 			removeWindow(w);
-			delete w;
+			redraw.erase(w);
+			w->close();
+			if(w->busy)
+			{
+				w->closed = true;
+				++closing;
+			}
+			else
+				delete w;
 		}
 		for(auto w : windows)
-			w->render();
-
-		SDL_Delay(10);
+		{
+			if(w->busy)
+				continue;
+			if(w->lastRendered != w->storage->computedSteps)
+			{
+				queuePrepare(w, PREPAREJOB);
+				continue;
+			}
+			w->missingTiles(w->tileRequests);
+			if(w->tileRequests.size())
+			{
+				if((int)w->tileRequests.size() > TILEBATCH)
+					w->tileRequests.resize(TILEBATCH);
+				queuePrepare(w, TILEJOB);
+			}
+			else if(w->liveDue())
+				queuePrepare(w, LIVEJOB);
+		}
+		for(auto w : redraw)
+			w->present();
 
 		winMutex.lock();
 	}
 	renderThreadAlive = false;
 	winMutex.unlock();
+
+	jobMtx.lock();
+	workersQuit = true;
+	jobCv.notify_all();
+	jobMtx.unlock();
+	for(auto &t : workers)
+		t.join();
+	workers.clear();
 }
@@ -2,48 +2,274 @@
 #define _RENDERMANAGER_H_
 
 #include <set>
+#include <map>
 #include <mutex>
 #include <thread>
 #include <algorithm>
 #include <tuple>
+#include <atomic>
+#include <deque>
+#include <condition_variable>
 
 #include <SDL2/SDL.h>
 
 #include "Storage.h"
+#include "Colormap.h"
 
 using namespace std;
 
+// How createToFile writes an image; set by the options of the save command.
+struct ExportOptions
+{
+	int level = 6;
+	int filter = -1;
+	int strategy = 1;
+	int depth = 8;
+	string palette;
+	// -1 streams only images too large for memory
+	int stream = -1;
+	bool box = false;
+
+	bool parse(const string &option);
+};
+
+// Tables a detail tile is coloured with, one per pyramid level. Modes
+// ranked on hits use the exact summary; the others rank against a sorted
+// sample of the keys of evenly spread tiles.
+struct LevelTables
+{
+	int step = -1;
+	RankTable hits;
+	vector<uint64_t> keys[3];
+};
+
+// A tile of a pyramid level as shown in a zoomed view window.
+struct ViewTile
+{
+	SDL_Texture *texture = 0;
+	int step = -1;
+	Uint32 lastUse = 0;
+};
+
+struct RenderedTile
+{
+	uint64_t key;
+	int w, h, step;
+	vector<Uint32> pixels;
+};
+
+enum ViewJob
+{
+	PREPAREJOB, LIVEJOB, TILEJOB
+};
+
 struct ViewWindow
 {
 	StorageElement *storage = 0;
 	SDL_Renderer *renderer = 0;
 	SDL_Window *window = 0;
 	Uint32 *pixels = 0;
+	float *field = 0;
 	SDL_Texture *texture = 0;
 
 	string type;
 	int lastRendered;
+	Uint32 lastLive = 0;
+	vector<uint64_t> liveVersion;
+	RankTable hitsRankTable;
+
+	// set by the UI thread while a preparation is queued or running; the
+	// worker leaves what changed in fullDirty and dirtyRects
+	bool busy = false, closed = false;
+	volatile bool cancelled = false;
+	ViewJob job = PREPAREJOB;
+	bool fullDirty = false;
+	vector<SDL_Rect> dirtyRects;
 
-	ViewWindow(StorageElement*, string);
+	// the view in level 0 pixels: zoom is pixels per screen pixel, viewX and
+	// viewY the top left corner. Below the zoom of the overview, tiles of a
+	// finer level are rendered on demand and drawn over it.
+	double zoom = 1, viewX = 0, viewY = 0;
+	int mouseX = 0, mouseY = 0;
+	bool dragging = false;
+	Uint32 frame = 0;
+	map<uint64_t, ViewTile> tiles;
+	vector<uint64_t> tileRequests;
+	vector<RenderedTile> tileResults;
+	map<int, LevelTables> levelTables;
+
+	int maxWidth, maxHeight;
+	int level = 0, width = 0, height = 0;
+	ExportOptions exportOptions;
+	Colormap colormap;
+	// renders this block instead of a level of the dataset
+	PixelBlock *snapshot = 0;
+
+	ViewWindow(StorageElement*, string, int maxWidth = 0, int maxHeight = 0);
 	~ViewWindow();
 
+	static uint32_t requiredChannels(const string &type);
+	static bool checkChannels(StorageElement *storage, const string &type);
+
+	void chooseLevel();
 	void create();
-	void createToFile(string filename);
+	bool createToFile(string filename);
+	bool writePNG(string filename);
+	vector<pair<string, string>> pngText();
+	bool writePFM(string filename);
+	bool streamToFile(string filename);
+	string description();
+	string cacheKey();
+	bool setColormap();
 	void renderPrepare();
-	void render();
+	float directionHue(int x, int y, int w, int h, uint64_t hits, double realOrig, double imagOrig);
+	void hitsRanks(RankTable &ranks, int k);
+	void renderLive();
+	bool liveDue();
+	void upload();
+	void present();
+	void close();
+
+	bool handleInput(const SDL_Event &event);
+	void clampView();
+	int detailLevel();
+	void missingTiles(vector<uint64_t> &keys);
+	LevelTables &tablesFor(int k);
+	void buildTables(int k, LevelTables &tables, int tileStride, int every);
+	void colourTile(int k, int t, const LevelTables &tables, float *rgb);
+	void renderTile(int k, int tx, int ty, LevelTables &tables, RenderedTile &out);
+	void renderTiles();
+	void uploadTiles();
+
+
+	// stores a normalized colour, and keeps it unquantized for 16 bit and
+	// float exports
+	void setPixel(int index, const float *rgb)
+	{
+		pixels[index] = Colormap::argb(rgb[0], rgb[1], rgb[2]);
+		if(field)
+			copy(rgb, rgb + 3, field + index * 3);
+	}
 };
 
+// What a written image shows, as recorded by RenderCache.
+struct RenderOutput
+{
+	string key;
+	long long size;
+};
+
+// Remembers the key of every image save, renderall and the control socket
+// write, in storage/render.cache, so an output whose dataset has not
+// advanced since is kept, or hard linked from another output with the same
+// key, instead of being rendered again.
+struct RenderCache
+{
+	string filename = "storage/render.cache";
+	map<string, RenderOutput> outputs;
+	int hits = 0, linked = 0, misses = 0;
+	mutex mtx;
+
+	void load();
+	void save();
+	bool lookup(const string &path, const string &key);
+	void record(const string &path, const string &key);
+	void report();
+};
+
+// Renders every dataset in every mode to files. A dataset is acquired once
+// for all of its modes, several datasets render at once as long as their
+// estimated memory fits the budget, and PNG encoding runs on its own thread.
+struct BatchRenderer
+{
+	string folder;
+	vector<StorageElement*> datasets;
+	vector<string> types;
+	bool skipUnsupported = false;
+	RenderCache *cache = 0;
+
+	mutex mtx;
+	condition_variable cv;
+	size_t memoryUsed = 0;
+	int nextDataset = 0, rendering = 0, written = 0;
+	deque<pair<ViewWindow*, string>> encodeQueue;
+
+	void run();
+	void worker();
+	void encoder();
+	string outputName(int dataset, int type);
+	size_t estimateMemory(StorageElement *s, int modes);
+	void reserveMemory(size_t bytes);
+	void releaseMemory(size_t bytes);
+};
+
+// Time-lapse output of a calculation, from the frames=, frametype= and
+// every= options of calc.
+struct FrameOptions
+{
+	string path, type = "hits";
+	int every = 0;
+
+	bool parse(const string &option);
+};
+
+// Records a calculation as a Y4M video, or as numbered PPM images if the
+// path is not a .y4m file. A frame is taken after every step and, with
+// every set, every that many stripes. The calculation only queues the
+// request; the recorder's own thread reads the frame from the pyramid level
+// of its size and the running step's tiles, then ranks, colours and writes
+// it. Frames it can not keep up with are dropped instead of stalling the
+// calculation.
+struct FrameRecorder
+{
+	FrameOptions options;
+	StorageElement *storage = 0;
+	int level = 0, width = 0, height = 0;
+	uint32_t channels = 0;
+	bool y4m = false;
+	FILE *video = 0;
+	int frames = 0, dropped = 0;
+
+	mutex mtx;
+	condition_variable cv;
+	// the frames asked for, true if they include the running step
+	deque<bool> queue;
+	bool finished = false;
+	thread encoder;
+
+	bool start(StorageElement *s, const FrameOptions &opt);
+	void capture(bool running);
+	void build(PixelBlock &frame, bool running);
+	void finish();
+	void encode();
+	void write(const Uint32 *pixels);
+};
+
+// Owns the view windows. The SDL event thread only handles events and
+// uploads; render preparation runs on a small worker pool, which reports
+// finished windows back with an SDL user event.
 struct RenderManager
 {
 	volatile bool renderThreadAlive = false;
 	set<ViewWindow*> windows, newWindows;
 	mutex winMutex;
+	int closing = 0;
+
+	mutex jobMtx;
+	condition_variable jobCv;
+	deque<ViewWindow*> jobs;
+	vector<thread> workers;
+	bool workersQuit = false;
+	Uint32 preparedEvent = 0, wakeEvent = 0;
+
 	RenderManager();
 	~RenderManager();
 
 	void addWindow(ViewWindow*);
 	void removeWindow(ViewWindow*);	
 	void renderThread();
+	void queuePrepare(ViewWindow*, ViewJob job);
+	void prepareWorker();
 };
 
 #endif
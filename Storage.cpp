@@ -1,7 +1,81 @@
 #include "Storage.h"
 #include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
 #include <SDL2/SDL_endian.h>
 
+static_assert(sizeof(PixelData) == CHANNELCOUNT * sizeof(uint64_t), "PixelData is read as raw big endian words");
+
+const char *channelNames[CHANNELCOUNT] = {
+	"hits", "realOrig", "imagOrig", "realLast", "imagLast", "steps", "reachedStep", "startHits", "startSteps"
+};
+
+const vector<AccumulatorProfile> profiles = {
+	{ "full", ALLCHANNELS, false },
+	{ "origin", ORIGINCHANNELS, false },
+	{ "hits", channelBit(HITS), true },
+};
+
+const AccumulatorProfile *findProfile(const string &name)
+{
+	for(auto &p : profiles)
+		if(name == p.name)
+			return &p;
+	return nullptr;
+}
+
+const vector<string> samplings = { "grid", "sobol", "r2", "jitter" };
+
+bool isSampling(const string &name)
+{
+	return find(samplings.begin(), samplings.end(), name) != samplings.end();
+}
+
+bool OrbitFilter::parse(const string &option)
+{
+	auto eq = option.find('=');
+	if(eq == string::npos)
+		return false;
+	string key = option.substr(0, eq), val = option.substr(eq + 1);
+	if(val.empty() || !all_of(val.begin(), val.end(), ::isdigit))
+		return false;
+	if(key == "minorbit")
+		minLength = stoi(val);
+	else if(key == "maxorbit")
+		maxLength = stoi(val);
+	else if(key == "thin" && stoi(val) > 0)
+		thin = stoi(val);
+	else
+		return false;
+	return true;
+}
+
+string OrbitFilter::str() const
+{
+	string s;
+	if(minLength)
+		s += " minorbit=" + to_string(minLength);
+	if(maxLength)
+		s += " maxorbit=" + to_string(maxLength);
+	if(thin != 1)
+		s += " thin=" + to_string(thin);
+	return s.empty() ? s : s.substr(1);
+}
+
+string channelList(uint32_t channels)
+{
+	string res;
+	for(int c = 0; c < CHANNELCOUNT; ++c)
+	{
+		if(!(channels & (1u << c)))
+			continue;
+		if(!res.empty())
+			res += ", ";
+		res += channelNames[c];
+	}
+	return res;
+}
+
 template<typename T>
 void write(FILE *file, const T &t);
 
@@ -47,36 +121,394 @@ void read(FILE *file, double &t)
 	read(file, *reinterpret_cast<uint64_t *>(&t));
 }
 
-void PixelData::load(FILE *file)
+static void swapWords(uint64_t *words, size_t n)
+{
+	for(size_t i = 0; i < n; ++i)
+		words[i] = SDL_SwapBE64(words[i]);
+}
+
+TileCache::~TileCache()
+{
+	if(file)
+		fclose(file);
+	if(scratchFile)
+		fclose(scratchFile);
+}
+
+void TileCache::open(string filename, int width, int height, uint32_t channels, long offset)
+{
+	this->filename = filename;
+	this->offset = offset;
+	this->channels = channels;
+	this->width = width;
+	this->height = height;
+	tilesX = (width + TILESIZE - 1) / TILESIZE;
+	tilesY = (height + TILESIZE - 1) / TILESIZE;
+	maxResident = max<size_t>(CHANNELCOUNT, TILEMEMORY / (TILESIZE * TILESIZE * sizeof(uint64_t)));
+	resident = 0;
+	useClock = 0;
+	tiles.clear();
+	tiles.resize(tileCount());
+	if(file)
+		fclose(file);
+	file = fopen(filename.c_str(), "r+b");
+	if(scratchFile)
+		fclose(scratchFile);
+	scratchFile = 0;
+	scratch.clear();
+	moved.clear();
+}
+
+// Each column is copied under the cache lock and written with only the file
+// lock held, so pins from other threads are not blocked by the disk.
+void TileCache::flush()
+{
+	Column buffer;
+	for(int t = 0; t < tileCount(); ++t)
+	{
+		for(int c = 0; c < CHANNELCOUNT; ++c)
+		{
+			mtx.lock();
+			if(!(tiles[t].dirty & (1u << c)))
+			{
+				mtx.unlock();
+				continue;
+			}
+			columnWords(t, c, buffer);
+			tiles[t].dirty &= ~(1u << c);
+			io.lock();
+			mtx.unlock();
+			writeColumn(t, c, buffer);
+			io.unlock();
+		}
+	}
+	io.lock();
+	if(file)
+		fflush(file);
+	if(scratchFile)
+		fflush(scratchFile);
+	io.unlock();
+}
+
+void TileCache::close()
+{
+	flush();
+	discard();
+}
+
+// A rewrite stays in progress, but starts over with an empty scratch file.
+void TileCache::discard()
+{
+	mtx.lock();
+	io.lock();
+	vector<Tile>().swap(tiles);
+	tiles.resize(tileCount());
+	resident = 0;
+	if(file)
+		fclose(file);
+	file = 0;
+	if(scratchFile)
+		fclose(scratchFile);
+	scratchFile = 0;
+	if(rewriting())
+	{
+		remove(scratch.c_str());
+		moved.assign(tileCount(), 0);
+	}
+	io.unlock();
+	mtx.unlock();
+}
+
+// A scratch file left over from an earlier run is never read; it is removed.
+void TileCache::rewrite(string scratch)
+{
+	mtx.lock();
+	io.lock();
+	if(scratchFile)
+		fclose(scratchFile);
+	scratchFile = 0;
+	this->scratch = scratch;
+	remove(scratch.c_str());
+	moved.assign(tileCount(), 0);
+	io.unlock();
+	mtx.unlock();
+}
+
+// Writes the dirty columns and copies the ones never written from the file,
+// so the scratch file holds the whole cache. The words before offset are the
+// caller's.
+void TileCache::complete()
+{
+	flush();
+	if(!rewriting())
+		return;
+	Column buffer;
+	io.lock();
+	if(!scratchFile)
+		scratchFile = fopen(scratch.c_str(), "w+b");
+	for(int t = 0; t < tileCount(); ++t)
+	{
+		int x0, y0, w, h;
+		tileRect(t, x0, y0, w, h);
+		for(int c = 0; c < CHANNELCOUNT; ++c)
+		{
+			if(!(channels & (1u << c)) || (moved[t] & (1u << c)))
+				continue;
+			buffer.assign(w * h, 0);
+			if(file)
+			{
+				fseek(file, tileOffset(t, c), SEEK_SET);
+				fread(buffer.data(), sizeof(uint64_t), buffer.size(), file);
+			}
+			fseek(scratchFile, tileOffset(t, c), SEEK_SET);
+			fwrite(buffer.data(), sizeof(uint64_t), buffer.size(), scratchFile);
+			moved[t] |= 1u << c;
+		}
+	}
+	fflush(scratchFile);
+	io.unlock();
+}
+
+// Renames the completed scratch file over the file and goes on with it.
+void TileCache::replace()
+{
+	if(!rewriting())
+		return;
+	mtx.lock();
+	io.lock();
+	if(file)
+		fclose(file);
+	rename(scratch.c_str(), filename.c_str());
+	file = scratchFile;
+	scratchFile = 0;
+	scratch.clear();
+	moved.clear();
+	io.unlock();
+	mtx.unlock();
+}
+
+void TileCache::tileRect(int tile, int &x0, int &y0, int &w, int &h) const
+{
+	x0 = tile % tilesX * TILESIZE;
+	y0 = tile / tilesX * TILESIZE;
+	w = min(TILESIZE, width - x0);
+	h = min(TILESIZE, height - y0);
+}
+
+long TileCache::tileOffset(int tile, int channel) const
+{
+	int x0, y0, w, h;
+	tileRect(tile, x0, y0, w, h);
+	long plane = (long)width * height * __builtin_popcount(channels & ((1u << channel) - 1));
+	return offset + (plane + (long)y0 * width + (long)x0 * h) * sizeof(uint64_t);
+}
+
+// hitsHeadroom is the number of hits the caller is about to add; a narrow
+// tile is widened first if that could overflow. Only one thread may pin
+// tiles of a narrow cache, as widening moves the hits column.
+PixelColumns TileCache::pin(int tile, uint32_t request, uint64_t hitsHeadroom)
+{
+	request &= channels;
+	mtx.lock();
+	auto &t = tiles[tile];
+	t.pins++;
+	t.lastUse = ++useClock;
+	for(int c = 0; c < CHANNELCOUNT; ++c)
+	{
+		if(!(request & (1u << c)) || (t.loaded & (1u << c)))
+			continue;
+		while(resident >= maxResident && evictOne());
+		loadColumn(tile, c);
+	}
+
+	if(t.narrow && hitsHeadroom && t.hitsBound + hitsHeadroom > UINT32_MAX)
+	{
+		auto hits32 = reinterpret_cast<uint32_t*>(t.columns[HITS].data());
+		int x0, y0, w, h;
+		tileRect(tile, x0, y0, w, h);
+		t.hitsBound = *max_element(hits32, hits32 + w * h);
+		if(t.hitsBound + hitsHeadroom > UINT32_MAX)
+			widenHits(tile);
+	}
+	t.hitsBound += hitsHeadroom;
+
+	auto col = [&](int c){ return request & (1u << c) ? t.columns[c].data() : nullptr; };
+	PixelColumns res;
+	for(int c = 0; c < CHANNELCOUNT; ++c)
+		res.words[c] = col(c);
+	if(t.narrow)
+	{
+		res.hits32 = reinterpret_cast<uint32_t*>(res.words[HITS]);
+		res.words[HITS] = nullptr;
+	}
+	res.hits = res.words[HITS];
+	res.realOrig = reinterpret_cast<double*>(col(REALORIG));
+	res.imagOrig = reinterpret_cast<double*>(col(IMAGORIG));
+	res.realLast = reinterpret_cast<double*>(col(REALLAST));
+	res.imagLast = reinterpret_cast<double*>(col(IMAGLAST));
+	res.steps = col(STEPS);
+	res.reachedStep = col(REACHEDSTEP);
+	res.startHits = col(STARTHITS);
+	res.startSteps = col(STARTSTEPS);
+	mtx.unlock();
+	return res;
+}
+
+void TileCache::unpin(int tile, uint32_t dirty)
+{
+	mtx.lock();
+	tiles[tile].pins--;
+	tiles[tile].dirty |= dirty & tiles[tile].loaded;
+	mtx.unlock();
+}
+
+void TileCache::forEach(uint32_t channels, function<void(int, int, int, int, PixelColumns&)> fn, uint32_t dirty)
+{
+	for(int t = 0; t < tileCount(); ++t)
+	{
+		int x0, y0, w, h;
+		tileRect(t, x0, y0, w, h);
+		PixelColumns cols = pin(t, channels);
+		fn(x0, y0, w, h, cols);
+		unpin(t, dirty);
+	}
+}
+
+// Like forEach, but the tiles are handed out to one thread per core, so fn
+// must only touch the tile it is given.
+void TileCache::parallelForEach(uint32_t channels, function<void(int, int, int, int, PixelColumns&)> fn, uint32_t dirty)
 {
-	read(file, hits);
-	read(file, realOrig);
-	read(file, imagOrig);
-	read(file, realLast);
-	read(file, imagLast);
-	read(file, steps);
-	read(file, reachedStep);
-	read(file, startHits);
-	read(file, startSteps);
+	atomic<int> next(0);
+	auto work = [&](){
+		for(int t; (t = next++) < tileCount();)
+		{
+			int x0, y0, w, h;
+			tileRect(t, x0, y0, w, h);
+			PixelColumns cols = pin(t, channels);
+			fn(x0, y0, w, h, cols);
+			unpin(t, dirty);
+		}
+	};
+	int n = min<int>(max(1u, thread::hardware_concurrency()), tileCount());
+	vector<thread> pool;
+	for(int i = 1; i < n; ++i)
+		pool.emplace_back(work);
+	work();
+	for(auto &t : pool)
+		t.join();
 }
 
-void PixelData::save(FILE *file)
+void TileCache::loadColumn(int tile, int channel)
 {
-	write(file, hits);
-	write(file, realOrig);
-	write(file, imagOrig);
-	write(file, realLast);
-	write(file, imagLast);
-	write(file, steps);
-	write(file, reachedStep);
-	write(file, startHits);
-	write(file, startSteps);
+	int x0, y0, w, h;
+	tileRect(tile, x0, y0, w, h);
+	auto &t = tiles[tile];
+	auto &col = t.columns[channel];
+	col.resize(w * h);
+	t.loaded |= 1u << channel;
+	t.dirty &= ~(1u << channel);
+	++resident;
+
+	size_t got = 0;
+	io.lock();
+	FILE *from = rewriting() && (moved[tile] & (1u << channel)) ? scratchFile : file;
+	if(from)
+	{
+		fseek(from, tileOffset(tile, channel), SEEK_SET);
+		got = fread(col.data(), sizeof(uint64_t), col.size(), from);
+	}
+	io.unlock();
+	swapWords(col.data(), got);
+	fill(col.begin() + got, col.end(), 0);
+
+	if(channel == HITS && narrowHits && *max_element(col.begin(), col.end()) <= UINT32_MAX)
+	{
+		Column packed((col.size() + 1) / 2);
+		auto hits32 = reinterpret_cast<uint32_t*>(packed.data());
+		for(size_t i = 0; i < col.size(); ++i)
+			hits32[i] = col[i];
+		t.hitsBound = *max_element(hits32, hits32 + col.size());
+		t.narrow = true;
+		col.swap(packed);
+	}
+}
+
+// The words of a column as stored in the file, narrow hits widened.
+void TileCache::columnWords(int tile, int channel, Column &buffer)
+{
+	auto &t = tiles[tile];
+	if(channel != HITS || !t.narrow)
+	{
+		buffer = t.columns[channel];
+		return;
+	}
+	int x0, y0, w, h;
+	tileRect(tile, x0, y0, w, h);
+	auto hits32 = reinterpret_cast<const uint32_t*>(t.columns[HITS].data());
+	buffer.assign(hits32, hits32 + w * h);
+}
+
+void TileCache::widenHits(int tile)
+{
+	auto &t = tiles[tile];
+	Column wide;
+	columnWords(tile, HITS, wide);
+	t.columns[HITS].swap(wide);
+	t.narrow = false;
+}
+
+void TileCache::writeColumn(int tile, int channel, Column &buffer)
+{
+	FILE *&to = rewriting() ? scratchFile : file;
+	if(!to)
+		to = fopen((rewriting() ? scratch : filename).c_str(), "w+b");
+	if(rewriting())
+		moved[tile] |= 1u << channel;
+
+	swapWords(buffer.data(), buffer.size());
+	fseek(to, tileOffset(tile, channel), SEEK_SET);
+	fwrite(buffer.data(), sizeof(uint64_t), buffer.size(), to);
+}
+
+bool TileCache::evictOne()
+{
+	int victim = -1;
+	for(int t = 0; t < tileCount(); ++t)
+	{
+		if(!tiles[t].loaded || tiles[t].pins)
+			continue;
+		if(victim < 0 || tiles[t].lastUse < tiles[victim].lastUse)
+			victim = t;
+	}
+	if(victim < 0)
+		return false;
+
+	auto &t = tiles[victim];
+	for(int c = 0; c < CHANNELCOUNT; ++c)
+	{
+		if(!(t.loaded & (1u << c)))
+			continue;
+		if(t.dirty & (1u << c))
+		{
+			if(c == HITS && t.narrow)
+				widenHits(victim);
+			io.lock();
+			writeColumn(victim, c, t.columns[c]);
+			io.unlock();
+		}
+		Column().swap(t.columns[c]);
+		--resident;
+	}
+	t.loaded = 0;
+	t.dirty = 0;
+	t.narrow = false;
+	return true;
 }
 
 void StorageElement::loadHeader()
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.header", uid);
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.header", dir.c_str(), uid);
 
 	auto file = fopen(filename, "r");
 
@@ -88,14 +520,40 @@ void StorageElement::loadHeader()
 	fscanf(file, "%lf %lf\n", &complexWidth, &complexHeight);
 	fscanf(file, "%d\n", &computedSteps);
 	fscanf(file, "%d\n", &skipPoints);
+	if(fscanf(file, "%d\n", &dataFormat) != 1)
+		dataFormat = 0;
+	if(fscanf(file, "%d %d\n", &shardIndex, &shardCount) != 2)
+	{
+		shardIndex = 0;
+		shardCount = 1;
+	}
+	if(fscanf(file, "%d\n", &pyramidLevels) != 1)
+		pyramidLevels = 0;
+	if(fscanf(file, "%255s\n", buffer) != 1 || !setProfile(buffer))
+		setProfile("full");
+	if(fscanf(file, "%255s\n", buffer) == 1 && isSampling(buffer))
+		sampling = buffer;
+	else
+		sampling = "grid";
+	if(fscanf(file, "%d %d %d\n", &filter.minLength, &filter.maxLength, &filter.thin) != 3 || filter.thin < 1)
+		filter = OrbitFilter();
+	if(fscanf(file, "%d %d %lf %lf\n", &seedWidth, &seedHeight, &seedComplexWidth, &seedComplexHeight) != 4)
+	{
+		seedWidth = seedHeight = 0;
+		seedComplexWidth = seedComplexHeight = 0;
+	}
+	if(fscanf(file, "%lf %lf\n", &centerReal, &centerImag) != 2)
+		centerReal = centerImag = 0;
 
 	fclose(file);
+
+	loadConvergence();
 }
 
 void StorageElement::loadDivergenceTable()
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.div", uid);
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.div", dir.c_str(), uid);
 
 	auto file = fopen(filename, "rb");
 
@@ -114,65 +572,81 @@ void StorageElement::loadDivergenceTable()
 
 void StorageElement::loadData()
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.data", uid);
-
-	auto file = fopen(filename, "rb");
+	upgradeDataFormat();
 
-	data.resize(width * height);
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.data", dir.c_str(), uid);
 
-	if(!file)
-		return;
-
-	for (int i = 0; i < width * height; ++i)
-		data[i].load(file);
+	data.open(filename, width, height, channels);
 
-	fclose(file);
+	for(int k = 1; k <= pyramidDepth(); ++k)
+	{
+		sprintf(filename, "%s/storage_%d.l%d", dir.c_str(), uid, k);
+		levels.push_back(new TileCache());
+		levels.back()->open(filename, levelWidth(k), levelHeight(k), channels);
+	}
+	loadSummary();
 
 	dataDirty = false;
 }
 
-void StorageElement::loadPauseData(vector<PixelData> &dat, uint64_t &stripe)
+void StorageElement::loadPauseData(TileCache &dat, uint64_t &stripe)
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.pause", uid);
-
-	auto file = fopen(filename, "rb");
+	upgradeDataFormat();
 
-	if(!file)
-		return;
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.pause", dir.c_str(), uid);
 
-	read(file, stripe);
+	dat.open(filename, width, height, channels, sizeof(uint64_t));
+	dat.narrowHits = narrowHits;
+	// the running step pages to storage_<uid>.step, so the pause data stays
+	// as it was saved until the step is paused again or merged
+	sprintf(filename, "%s/storage_%d.step", dir.c_str(), uid);
+	dat.rewrite(filename);
 
-	for (int i = 0; i < width * height; ++i)
-		dat[i].load(file);
+	if(!dat.file)
+		return;
 
-	fclose(file);
+	fseek(dat.file, 0, SEEK_END);
+	if(ftell(dat.file) < (long)sizeof(uint64_t))
+		return;
+	fseek(dat.file, 0, SEEK_SET);
+	read(dat.file, stripe);
 }
 
 void StorageElement::saveHeader()
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.header", uid);
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.header", dir.c_str(), uid);
 
 	auto file = fopen(filename, "w");
 
 	fprintf(file, "%s\n", formula.c_str());
 	fprintf(file, "%d %d\n", width, height);
 	fprintf(file, "%d %d\n", steps, divergenceThreshold);
-	fprintf(file, "%lf %lf\n", complexWidth, complexHeight);
+	fprintf(file, "%.17g %.17g\n", complexWidth, complexHeight);
 	fprintf(file, "%d\n", computedSteps);
 	fprintf(file, "%d\n", skipPoints);
+	fprintf(file, "%d\n", dataFormat);
+	fprintf(file, "%d %d\n", shardIndex, shardCount);
+	fprintf(file, "%d\n", pyramidLevels);
+	fprintf(file, "%s\n", profile.c_str());
+	fprintf(file, "%s\n", sampling.c_str());
+	fprintf(file, "%d %d %d\n", filter.minLength, filter.maxLength, filter.thin);
+	fprintf(file, "%d %d %.17g %.17g\n", seedWidth, seedHeight, seedComplexWidth, seedComplexHeight);
+	fprintf(file, "%.17g %.17g\n", centerReal, centerImag);
 
 	fclose(file);
 
+	saveConvergence();
+
 	headerSaved = true;
 }
 
 void StorageElement::saveDivergenceTable()
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.div", uid);
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.div", dir.c_str(), uid);
 
 	auto file = fopen(filename, "wb");
 
@@ -186,32 +660,107 @@ void StorageElement::saveDivergenceTable()
 
 void StorageElement::saveData()
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.data", uid);
+	if(data.rewriting())
+	{
+		// not before the merge is done and counted
+		if(computedSteps == rewrittenStep)
+			commitData();
+		return;
+	}
+	data.flush();
+	for(auto l : levels)
+		l->flush();
+	if(summaryDirty)
+		saveSummary();
 
-	auto file = fopen(filename, "wb");
+	dataDirty = false;
+}
 
-	for (int i = 0; i < width * height; ++i)
-		data[i].save(file);
+// The step file becomes the pause data only once it is complete and holds
+// the stripe it belongs to.
+void StorageElement::savePauseData(TileCache &dat, uint64_t stripe)
+{
+	dat.complete();
+	fseek(dat.scratchFile, 0, SEEK_SET);
+	write(dat.scratchFile, stripe);
+	fflush(dat.scratchFile);
+	dat.replace();
 
-	fclose(file);
+	dat.close();
+}
 
-	dataDirty = false;
+// Sends the writes of a merge to storage_<uid>.data.new and, if the pyramid
+// is stored, the .l<k>.new files, so the files of the last step stay intact
+// until commitData.
+void StorageElement::rewriteData()
+{
+	rewrittenStep = computedSteps + 1;
+	data.rewrite(data.filename + ".new");
+	if(pyramidLevels)
+		for(auto l : levels)
+			l->rewrite(l->filename + ".new");
 }
 
-void StorageElement::savePauseData(vector<PixelData> &dat, uint64_t stripe)
+// storage_<uid>.commit names the step the .new files hold while they replace
+// the old files; after a crash in between, recoverCommit finishes the job.
+// The header moves on to the step only after that.
+void StorageElement::commitData()
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.pause", uid);
+	data.complete();
+	for(auto l : levels)
+		l->complete();
 
-	auto file = fopen(filename, "wb");
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.commit", dir.c_str(), uid);
+	auto file = fopen(filename, "w");
+	fprintf(file, "%d\n", computedSteps);
+	fclose(file);
+
+	data.replace();
+	for(auto l : levels)
+		l->replace();
+	saveHeader();
+	if(summaryDirty)
+		saveSummary();
+	remove(filename);
 
-	write(file, stripe);
+	dataDirty = false;
+}
 
-	for (int i = 0; i < width * height; ++i)
-		dat[i].save(file);
+// A merge that crashed before its commit marker was written leaves the old
+// files and header, and its .new files are dropped; one that crashed after is
+// finished.
+void StorageElement::recoverCommit()
+{
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.commit", dir.c_str(), uid);
+	int step = -1;
+	auto file = fopen(filename, "r");
+	if(file)
+	{
+		if(fscanf(file, "%d", &step) != 1)
+			step = -1;
+		fclose(file);
+	}
 
-	fclose(file);
+	vector<string> names = {"data"};
+	for(int k = 1; k <= pyramidDepth(); ++k)
+		names.push_back("l" + to_string(k));
+	for(auto &name : names)
+	{
+		string path = dir + "/storage_" + to_string(uid) + "." + name;
+		if(step >= 0)
+			rename((path + ".new").c_str(), path.c_str());
+		else
+			remove((path + ".new").c_str());
+	}
+	if(step >= 0)
+	{
+		printf("finishing the interrupted save of step %d of dataset %d\n", step, uid);
+		computedSteps = step;
+		saveHeader();
+	}
+	remove(filename);
 }
 
 void StorageElement::aquireDivergenceTable()
@@ -250,19 +799,549 @@ void StorageElement::releaseData()
 	if(dataDirty)
 		saveData();
 	if(!dataUsage)
-		vector<PixelData>().swap(data);
+	{
+		data.close();
+		for(auto l : levels)
+		{
+			l->close();
+			delete l;
+		}
+		levels.clear();
+		vector<ValueHistogram>().swap(hitsSummary);
+		summaryValid = false;
+	}
 	mtx.unlock();
 }
 
 void StorageElement::deletePauseData()
 {
-	char filename[128];
-	sprintf(filename, "storage/storage_%d.pause", uid);
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.pause", dir.c_str(), uid);
+	remove(filename);
+	sprintf(filename, "%s/storage_%d.step", dir.c_str(), uid);
 	remove(filename);
 }
 
+// Older datasets store interleaved PixelData records, either row-major
+// (format 0) or tile-major (format 1). Both .data and .pause are split into
+// one tile-major plane per channel; the words stay big endian, so this is a
+// pure byte shuffle.
+void StorageElement::upgradeDataFormat()
+{
+	if(dataFormat >= DATAFORMAT)
+		return;
+
+	TileCache layout;
+	layout.width = width;
+	layout.height = height;
+	layout.tilesX = (width + TILESIZE - 1) / TILESIZE;
+	layout.tilesY = (height + TILESIZE - 1) / TILESIZE;
+
+	for(auto ext : {"data", "pause"})
+	{
+		char filename[512], tmpname[512];
+		sprintf(filename, "%s/storage_%d.%s", dir.c_str(), uid, ext);
+		sprintf(tmpname, "%s/storage_%d.%s.planes", dir.c_str(), uid, ext);
+
+		auto in = fopen(filename, "rb");
+		if(!in)
+			continue;
+
+		printf("converting %s to channel planes... ", filename);
+		fflush(stdout);
+
+		auto out = fopen(tmpname, "wb");
+		layout.offset = 0;
+		if(ext == "pause"s)
+		{
+			uint64_t stripe;
+			fread(&stripe, sizeof(uint64_t), 1, in);
+			fwrite(&stripe, sizeof(uint64_t), 1, out);
+			layout.offset = sizeof(uint64_t);
+		}
+
+		vector<PixelData> band, records;
+		vector<uint64_t> column;
+		for(int ty = 0; ty < layout.tilesY; ++ty)
+		{
+			int rows = min(TILESIZE, height - ty * TILESIZE);
+			if(dataFormat == 0)
+			{
+				band.assign((size_t)width * rows, PixelData());
+				fread(band.data(), sizeof(PixelData), band.size(), in);
+			}
+			for(int tx = 0; tx < layout.tilesX; ++tx)
+			{
+				int tile = tx + ty * layout.tilesX;
+				int x0, y0, w, h;
+				layout.tileRect(tile, x0, y0, w, h);
+				records.assign(w * h, PixelData());
+				if(dataFormat == 0)
+				{
+					for(int y = 0; y < h; ++y)
+						copy_n(&band[x0 + (size_t)y * width], w, &records[y * w]);
+				}
+				else
+				{
+					fseek(in, layout.offset + ((long)y0 * width + (long)x0 * h) * sizeof(PixelData), SEEK_SET);
+					fread(records.data(), sizeof(PixelData), records.size(), in);
+				}
+
+				column.resize(records.size());
+				for(int c = 0; c < CHANNELCOUNT; ++c)
+				{
+					for(size_t i = 0; i < records.size(); ++i)
+						column[i] = reinterpret_cast<uint64_t*>(&records[i])[c];
+					fseek(out, layout.tileOffset(tile, c), SEEK_SET);
+					fwrite(column.data(), sizeof(uint64_t), column.size(), out);
+				}
+			}
+		}
+
+		fclose(in);
+		fclose(out);
+		rename(tmpname, filename);
+		printf("done\n");
+	}
+
+	dataFormat = DATAFORMAT;
+	saveHeader();
+}
+
+bool StorageElement::setProfile(const string &name)
+{
+	auto p = findProfile(name);
+	if(!p)
+		return false;
+	profile = p->name;
+	channels = p->channels;
+	narrowHits = p->narrowHits;
+	return true;
+}
+
+// Whether the orbits of this dataset are seeded by the job with that
+// resolution and window; all 0 asks for a dataset seeding itself.
+bool StorageElement::seededBy(int w, int h, double cw, double ch) const
+{
+	return seedWidth == w && seedHeight == h && abs(seedComplexWidth - cw) <= 1e-9 && abs(seedComplexHeight - ch) <= 1e-9;
+}
+
+// Whether the window is centred at re + im i, up to a billionth of its size.
+bool StorageElement::centredAt(double re, double im) const
+{
+	return abs(centerReal - re) <= 1e-9 * complexWidth && abs(centerImag - im) <= 1e-9 * complexHeight;
+}
+
+int StorageElement::pyramidDepth() const
+{
+	int k = 0;
+	while(max(levelWidth(k), levelHeight(k)) > 64)
+		++k;
+	return k;
+}
+
+// Largest level that fits into maxWidth x maxHeight, or the smallest level if
+// none does. A limit of 0 means no limit.
+int StorageElement::levelFor(int maxWidth, int maxHeight) const
+{
+	int depth = pyramidDepth();
+	for(int k = 0; k < depth; ++k)
+		if((!maxWidth || levelWidth(k) <= maxWidth) && (!maxHeight || levelHeight(k) <= maxHeight))
+			return k;
+	return depth;
+}
+
+// The columns of the block as if it were a pinned tile; empty ones are null.
+PixelColumns PixelBlock::view()
+{
+	PixelColumns res;
+	for(int c = 0; c < CHANNELCOUNT; ++c)
+		res.words[c] = columns[c].empty() ? nullptr : columns[c].data();
+	res.hits = res.words[HITS];
+	res.realOrig = reinterpret_cast<double*>(res.words[REALORIG]);
+	res.imagOrig = reinterpret_cast<double*>(res.words[IMAGORIG]);
+	res.realLast = reinterpret_cast<double*>(res.words[REALLAST]);
+	res.imagLast = reinterpret_cast<double*>(res.words[IMAGLAST]);
+	res.steps = res.words[STEPS];
+	res.reachedStep = res.words[REACHEDSTEP];
+	res.startHits = res.words[STARTHITS];
+	res.startSteps = res.words[STARTSTEPS];
+	return res;
+}
+
+// Sums every 2x2 block of src into dst; src may start at an odd position.
+void halveBlock(const PixelBlock &src, PixelBlock &dst)
+{
+	dst.x0 = src.x0 / 2;
+	dst.y0 = src.y0 / 2;
+	dst.w = (src.x0 + src.w - 1) / 2 - dst.x0 + 1;
+	dst.h = (src.y0 + src.h - 1) / 2 - dst.y0 + 1;
+	for(int c = 0; c < CHANNELCOUNT; ++c)
+	{
+		auto &out = dst.columns[c];
+		if(src.columns[c].empty())
+		{
+			out.clear();
+			continue;
+		}
+		out.assign(dst.w * dst.h, 0);
+		const uint64_t *in = src.columns[c].data();
+		for(int y = 0; y < src.h; ++y)
+		{
+			int row = ((src.y0 + y) / 2 - dst.y0) * dst.w - dst.x0;
+			for(int x = 0; x < src.w; ++x)
+			{
+				uint64_t &o = out[row + (src.x0 + x) / 2];
+				if(channelIsFloat(c))
+					reinterpret_cast<double&>(o) += reinterpret_cast<const double&>(in[x + y * src.w]);
+				else
+					o += in[x + y * src.w];
+			}
+		}
+	}
+}
+
+static void addBlock(TileCache &cache, const PixelBlock &b, ValueHistogram *hist)
+{
+	for(int ty = b.y0 / TILESIZE; ty <= (b.y0 + b.h - 1) / TILESIZE; ++ty)
+	{
+		for(int tx = b.x0 / TILESIZE; tx <= (b.x0 + b.w - 1) / TILESIZE; ++tx)
+		{
+			int tile = tx + ty * cache.tilesX;
+			int x0, y0, w, h;
+			cache.tileRect(tile, x0, y0, w, h);
+			int xs = max(x0, b.x0), xe = min(x0 + w, b.x0 + b.w);
+			int ys = max(y0, b.y0), ye = min(y0 + h, b.y0 + b.h);
+			PixelColumns cols = cache.pin(tile, ALLCHANNELS);
+			for(int c = 0; c < CHANNELCOUNT; ++c)
+			{
+				if(b.columns[c].empty() || !cols.words[c])
+					continue;
+				for(int y = ys; y < ye; ++y)
+				{
+					uint64_t *out = cols.words[c] + (y - y0) * w - x0;
+					const uint64_t *in = b.columns[c].data() + (y - b.y0) * b.w - b.x0;
+					if(c == HITS && hist)
+						hist->addDelta(out + xs, in + xs, xe - xs);
+					for(int x = xs; x < xe; ++x)
+					{
+						if(channelIsFloat(c))
+							reinterpret_cast<double&>(out[x]) += reinterpret_cast<const double&>(in[x]);
+						else
+							out[x] += in[x];
+					}
+				}
+			}
+			cache.unpin(tile, ALLCHANNELS);
+		}
+	}
+}
+
+// Adds a change of the data to every pyramid level. The caller holds
+// pyramidMtx and the data is acquired.
+void StorageElement::updatePyramid(const PixelBlock &delta)
+{
+	PixelBlock cur, next;
+	const PixelBlock *src = &delta;
+	for(int k = 1; k <= pyramidLevels; ++k)
+	{
+		halveBlock(*src, next);
+		addBlock(level(k), next, summaryValid ? &hitsSummary[k] : nullptr);
+		swap(cur, next);
+		src = &cur;
+	}
+}
+
+// Builds all levels from scratch if they are not stored yet. The data has to
+// be acquired. Datasets of at most 64 pixels have no levels to build.
+void StorageElement::buildPyramid()
+{
+	lock_guard<mutex> lock(pyramidMtx);
+	if(pyramidLevels || !pyramidDepth())
+		return;
+
+	printf("building pyramid... ");
+	fflush(stdout);
+
+	for(auto l : levels)
+	{
+		l->discard();
+		remove(l->filename.c_str());
+	}
+
+	pyramidLevels = pyramidDepth();
+	if(summaryValid)
+	{
+		hitsSummary.resize(pyramidLevels + 1);
+		for(int k = 1; k <= pyramidLevels; ++k)
+		{
+			hitsSummary[k].clear();
+			hitsSummary[k].add(0, (uint64_t)levelWidth(k) * levelHeight(k));
+		}
+		summaryDirty = true;
+	}
+	PixelBlock block;
+	for(int t = 0; t < data.tileCount(); ++t)
+	{
+		data.tileRect(t, block.x0, block.y0, block.w, block.h);
+		PixelColumns cols = data.pin(t, ALLCHANNELS);
+		for(int c = 0; c < CHANNELCOUNT; ++c)
+		{
+			if(cols.words[c])
+				block.columns[c].assign(cols.words[c], cols.words[c] + block.w * block.h);
+			else
+				block.columns[c].clear();
+		}
+		data.unpin(t);
+		updatePyramid(block);
+	}
+
+	headerSaved = false;
+	dataDirty = true;
+	printf("done\n");
+}
+
+// cache is the calculator's buffer for the running step and merge the mutex
+// it holds while writing to it; null when the calculation ends.
+void StorageElement::publishPending(TileCache *cache, mutex *merge)
+{
+	lock_guard<mutex> lock(liveMtx);
+	pending = cache;
+	pendingMerge = merge;
+	pendingProgress = 0;
+	if(cache)
+		pendingVersion.assign(cache->tileCount(), 0);
+}
+
+// Copies the running step's samples of one data tile if they changed since
+// version. Gives up instead of waiting when the calculator is merging.
+bool StorageElement::pendingTile(int tile, uint32_t channels, PixelBlock &out, uint64_t &version)
+{
+	lock_guard<mutex> lock(liveMtx);
+	if(!pending || !pendingMerge->try_lock())
+		return false;
+	if(pendingVersion[tile] == version)
+	{
+		pendingMerge->unlock();
+		return false;
+	}
+	version = pendingVersion[tile];
+
+	pending->tileRect(tile, out.x0, out.y0, out.w, out.h);
+	int n = out.w * out.h;
+	PixelColumns cols = pending->pin(tile, channels);
+	for(int c = 0; c < CHANNELCOUNT; ++c)
+	{
+		if(cols.words[c])
+			out.columns[c].assign(cols.words[c], cols.words[c] + n);
+		else
+			out.columns[c].clear();
+	}
+	if(cols.hits32)
+		out.columns[HITS].assign(cols.hits32, cols.hits32 + n);
+	pending->unpin(tile);
+	pendingMerge->unlock();
+	return true;
+}
+
+void ValueHistogram::clear()
+{
+	fill(dense.begin(), dense.end(), 0);
+	sparse.clear();
+}
+
+void ValueHistogram::add(uint64_t value, uint64_t count)
+{
+	if(value < DENSE)
+		dense[value] += count;
+	else
+		sparse[value] += count;
+}
+
+void ValueHistogram::remove(uint64_t value, uint64_t count)
+{
+	if(value < DENSE)
+	{
+		dense[value] -= count;
+		return;
+	}
+	auto it = sparse.find(value);
+	if(it == sparse.end())
+		return;
+	if(it->second <= count)
+		sparse.erase(it);
+	else
+		it->second -= count;
+}
+
+void RankTable::build(const ValueHistogram &hist)
+{
+	dense.resize(ValueHistogram::DENSE);
+	total = 0;
+	for(uint64_t v = 0; v < ValueHistogram::DENSE; ++v)
+	{
+		dense[v] = total;
+		total += hist.dense[v];
+	}
+
+	vector<pair<uint64_t, uint64_t>> entries(hist.sparse.begin(), hist.sparse.end());
+	sort(entries.begin(), entries.end());
+	values.resize(entries.size());
+	below.resize(entries.size());
+	for(size_t i = 0; i < entries.size(); ++i)
+	{
+		values[i] = entries[i].first;
+		below[i] = total;
+		total += entries[i].second;
+	}
+}
+
+// storage_<uid>.conv: a line per step with the step and its convergence
+// metric.
+void StorageElement::loadConvergence()
+{
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.conv", dir.c_str(), uid);
+
+	convergence.clear();
+	auto file = fopen(filename, "r");
+	if(!file)
+		return;
+	int step;
+	double change;
+	while(fscanf(file, "%d %lf\n", &step, &change) == 2)
+		convergence.emplace_back(step, change);
+	fclose(file);
+}
+
+void StorageElement::saveConvergence()
+{
+	if(convergence.empty())
+		return;
+
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.conv", dir.c_str(), uid);
+
+	auto file = fopen(filename, "w");
+	for(auto &c : convergence)
+		fprintf(file, "%d %.9g\n", c.first, c.second);
+	fclose(file);
+}
+
+// storage_<uid>.sum: the step it belongs to, the number of levels and per
+// level the (value, count) pairs of the hits histogram. A file from another
+// step is ignored and the summary is rebuilt on the next render.
+void StorageElement::loadSummary()
+{
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.sum", dir.c_str(), uid);
+
+	summaryValid = false;
+	summaryDirty = false;
+	auto file = fopen(filename, "rb");
+	if(!file)
+		return;
+
+	uint64_t step = 0, count = 0;
+	read(file, step);
+	read(file, count);
+	if(feof(file) || step != (uint64_t)computedSteps || count != (uint64_t)pyramidLevels + 1)
+	{
+		fclose(file);
+		return;
+	}
+
+	hitsSummary.assign(count, ValueHistogram());
+	for(auto &h : hitsSummary)
+	{
+		uint64_t entries = 0, value, n;
+		read(file, entries);
+		for(uint64_t i = 0; i < entries && !feof(file); ++i)
+		{
+			read(file, value);
+			read(file, n);
+			h.add(value, n);
+		}
+	}
+	summaryValid = !feof(file);
+	if(!summaryValid)
+		vector<ValueHistogram>().swap(hitsSummary);
+	fclose(file);
+}
+
+void StorageElement::saveSummary()
+{
+	lock_guard<mutex> lock(pyramidMtx);
+	if(!summaryValid)
+		return;
+
+	char filename[512];
+	sprintf(filename, "%s/storage_%d.sum", dir.c_str(), uid);
+
+	auto file = fopen(filename, "wb");
+	write(file, (uint64_t)computedSteps);
+	write(file, (uint64_t)hitsSummary.size());
+	for(auto &h : hitsSummary)
+	{
+		uint64_t entries = h.sparse.size();
+		for(auto c : h.dense)
+			entries += c != 0;
+		write(file, entries);
+		for(uint64_t v = 0; v < ValueHistogram::DENSE; ++v)
+		{
+			if(!h.dense[v])
+				continue;
+			write(file, v);
+			write(file, h.dense[v]);
+		}
+		for(auto &e : h.sparse)
+		{
+			write(file, e.first);
+			write(file, e.second);
+		}
+	}
+	fclose(file);
+
+	summaryDirty = false;
+}
+
+// Counts the hits of the data and every pyramid level if no valid summary
+// was loaded. The data has to be acquired.
+void StorageElement::buildSummary()
+{
+	lock_guard<mutex> lock(pyramidMtx);
+	if(summaryValid)
+		return;
+
+	printf("building value summary... ");
+	fflush(stdout);
+
+	hitsSummary.assign(pyramidLevels + 1, ValueHistogram());
+	for(int k = 0; k <= pyramidLevels; ++k)
+	{
+		auto &h = hitsSummary[k];
+		level(k).forEach(channelBit(HITS), [&](int, int, int w, int hgt, PixelColumns &tile){
+			for(int i = 0; i < w * hgt; ++i)
+				h.add(tile.hits[i]);
+		});
+	}
+	summaryValid = true;
+	summaryDirty = true;
+	dataDirty = true;
+	printf("done\n");
+}
+
 Storage::~Storage()
 {
+	sync();
+	if(ioThread.joinable())
+	{
+		queueMtx.lock();
+		ioQuit = true;
+		queueCv.notify_all();
+		queueMtx.unlock();
+		ioThread.join();
+	}
 	save();
 	for(auto s : saves)
 		delete s;
@@ -288,26 +1367,251 @@ void Storage::load()
 		s = new StorageElement();
 		fscanf(file, "%d\n", &s->uid);
 		s->loadHeader();
+		s->recoverCommit();
 	}
 	fclose(file);
 }
 
 void Storage::save()
 {
+	lock_guard<mutex> lock(saveMtx);
 	mkdir("storage", 0777);
-	auto file = fopen("storage/storage.index", "w");
+	// written aside, so a crash while the datasets are saved keeps the old one
+	auto file = fopen("storage/storage.index.new", "w");
 	fprintf(file, "%d\n", uidC);
 
 	fprintf(file, "%d\n", (int)saves.size());
 	for (auto &s : saves)
 	{
 		fprintf(file, "%d\n", s->uid);
-		if (!s->headerSaved)
-			s->saveHeader();
+		s->mtx.lock();
+		// the header must not count a step before its data is saved
 		if (s->divDirty)
 			s->saveDivergenceTable();
 		if (s->dataDirty)
 			s->saveData();
+		if (!s->headerSaved)
+			s->saveHeader();
+		s->mtx.unlock();
 	}
 	fclose(file);
+	rename("storage/storage.index.new", "storage/storage.index");
+}
+
+// Hands a save to the I/O thread. Datasets only change during the end-of-step
+// merge, which calls sync() first, so the thread always writes a consistent
+// step. If a save is still queued or running this blocks until it is done.
+void Storage::saveAsync()
+{
+	unique_lock<mutex> lock(queueMtx);
+	queueCv.wait(lock, [this]{ return !savePending && !saveRunning; });
+	if(!ioThread.joinable())
+		ioThread = thread(&Storage::ioWorker, this);
+	savePending = true;
+	queueCv.notify_all();
+}
+
+void Storage::sync()
+{
+	unique_lock<mutex> lock(queueMtx);
+	queueCv.wait(lock, [this]{ return !savePending && !saveRunning; });
+}
+
+void Storage::ioWorker()
+{
+	unique_lock<mutex> lock(queueMtx);
+	while(true)
+	{
+		queueCv.wait(lock, [this]{ return savePending || ioQuit; });
+		if(!savePending)
+			break;
+		savePending = false;
+		saveRunning = true;
+		lock.unlock();
+
+		save();
+
+		lock.lock();
+		saveRunning = false;
+		queueCv.notify_all();
+	}
+}
+
+template<typename T>
+static void addColumn(T *__restrict dst, const T *__restrict src, int n)
+{
+	for(int i = 0; i < n; ++i)
+		dst[i] += src[i];
+}
+
+// Combines the shards of one job, given as paths like
+// "node1/storage/storage_3", into a new complete dataset. The shards are
+// summed tile by tile, so only a few tiles of each are resident at a time.
+StorageElement *Storage::mergeShards(const vector<string> &paths)
+{
+	vector<StorageElement*> shards;
+	auto cleanup = [&](){
+		for(auto s : shards)
+			delete s;
+	};
+
+	for(auto path : paths)
+	{
+		if(path.size() > 7 && path.substr(path.size() - 7) == ".header")
+			path.resize(path.size() - 7);
+		auto slash = path.rfind('/');
+		auto shard = new StorageElement();
+		shard->dir = slash == string::npos ? "." : path.substr(0, slash);
+		if(sscanf(path.c_str() + (slash == string::npos ? 0 : slash + 1), "storage_%d", &shard->uid) != 1)
+		{
+			fprintf(stderr, "'%s' does not name a dataset (expected <dir>/storage_<uid>)\n", path.c_str());
+			delete shard;
+			cleanup();
+			return nullptr;
+		}
+
+		char filename[512];
+		sprintf(filename, "%s/storage_%d.header", shard->dir.c_str(), shard->uid);
+		auto file = fopen(filename, "r");
+		if(!file)
+		{
+			fprintf(stderr, "can not open '%s'\n", filename);
+			delete shard;
+			cleanup();
+			return nullptr;
+		}
+		fclose(file);
+		shard->loadHeader();
+		shards.push_back(shard);
+	}
+
+	if(shards.empty())
+	{
+		fprintf(stderr, "no shards given\n");
+		return nullptr;
+	}
+
+	auto first = shards[0];
+	vector<bool> seen(first->shardCount, false);
+	for(auto s : shards)
+	{
+		if(s->formula != first->formula || s->width != first->width || s->height != first->height ||
+				s->steps != first->steps || s->divergenceThreshold != first->divergenceThreshold ||
+				s->skipPoints != first->skipPoints || abs(s->complexWidth - first->complexWidth) > 1e-9 ||
+				abs(s->complexHeight - first->complexHeight) > 1e-9 ||
+				!s->seededBy(first->seedWidth, first->seedHeight, first->seedComplexWidth, first->seedComplexHeight) ||
+				!s->centredAt(first->centerReal, first->centerImag))
+		{
+			fprintf(stderr, "%s/storage_%d belongs to a different job\n", s->dir.c_str(), s->uid);
+			cleanup();
+			return nullptr;
+		}
+		if(s->computedSteps != first->computedSteps)
+		{
+			fprintf(stderr, "%s/storage_%d has %d computed steps, expected %d\n", s->dir.c_str(), s->uid, s->computedSteps, first->computedSteps);
+			cleanup();
+			return nullptr;
+		}
+		if(s->profile != first->profile)
+		{
+			fprintf(stderr, "%s/storage_%d uses profile %s, expected %s\n", s->dir.c_str(), s->uid, s->profile.c_str(), first->profile.c_str());
+			cleanup();
+			return nullptr;
+		}
+		if(s->sampling != first->sampling)
+		{
+			fprintf(stderr, "%s/storage_%d uses %s sampling, expected %s\n", s->dir.c_str(), s->uid, s->sampling.c_str(), first->sampling.c_str());
+			cleanup();
+			return nullptr;
+		}
+		if(s->filter != first->filter)
+		{
+			fprintf(stderr, "%s/storage_%d filters orbits by '%s', expected '%s'\n", s->dir.c_str(), s->uid, s->filter.str().c_str(), first->filter.str().c_str());
+			cleanup();
+			return nullptr;
+		}
+		if(s->shardCount != first->shardCount || s->shardIndex < 0 || s->shardIndex >= first->shardCount || seen[s->shardIndex])
+		{
+			fprintf(stderr, "%s/storage_%d is shard %d/%d, which does not fit the other shards\n", s->dir.c_str(), s->uid, s->shardIndex, s->shardCount);
+			cleanup();
+			return nullptr;
+		}
+		seen[s->shardIndex] = true;
+	}
+	if((int)shards.size() != first->shardCount)
+	{
+		fprintf(stderr, "got %d of %d shards\n", (int)shards.size(), first->shardCount);
+		cleanup();
+		return nullptr;
+	}
+
+	sync();
+	saves.push_back(new StorageElement());
+	auto out = saves.back();
+	out->formula = first->formula;
+	out->uid = uidC++;
+	out->divergenceThreshold = first->divergenceThreshold;
+	out->width = first->width;
+	out->height = first->height;
+	out->steps = first->steps;
+	out->skipPoints = first->skipPoints;
+	out->computedSteps = first->computedSteps;
+	out->complexWidth = first->complexWidth;
+	out->complexHeight = first->complexHeight;
+	out->setProfile(first->profile);
+	out->sampling = first->sampling;
+	out->filter = first->filter;
+	out->seedWidth = first->seedWidth;
+	out->seedHeight = first->seedHeight;
+	out->seedComplexWidth = first->seedComplexWidth;
+	out->seedComplexHeight = first->seedComplexHeight;
+	out->centerReal = first->centerReal;
+	out->centerImag = first->centerImag;
+	out->headerSaved = false;
+	save();
+
+	printf("merging %d shards... ", (int)shards.size());
+	fflush(stdout);
+
+	first->aquireDivergenceTable();
+	out->aquireDivergenceTable();
+	out->divergenceTable = first->divergenceTable;
+	out->divDirty = true;
+	out->releaseDivergenceTable();
+	first->releaseDivergenceTable();
+
+	out->aquireData();
+	for(auto s : shards)
+		s->aquireData();
+	for(int t = 0; t < out->data.tileCount(); ++t)
+	{
+		int x0, y0, w, h;
+		out->data.tileRect(t, x0, y0, w, h);
+		int n = w * h;
+		PixelColumns d = out->data.pin(t, ALLCHANNELS);
+		for(auto s : shards)
+		{
+			PixelColumns sd = s->data.pin(t, ALLCHANNELS);
+			for(int c = 0; c < CHANNELCOUNT; ++c)
+			{
+				if(!d.words[c])
+					continue;
+				if(channelIsFloat(c))
+					addColumn(reinterpret_cast<double*>(d.words[c]), reinterpret_cast<const double*>(sd.words[c]), n);
+				else
+					addColumn(d.words[c], sd.words[c], n);
+			}
+			s->data.unpin(t);
+		}
+		out->data.unpin(t, ALLCHANNELS);
+	}
+	for(auto s : shards)
+		s->releaseData();
+	out->dataDirty = true;
+	out->releaseData();
+	save();
+	cleanup();
+
+	printf("done\n");
+	return out;
 }
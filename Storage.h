@@ -6,10 +6,18 @@
 #include <cstdint>
 #include <complex>
 #include <functional>
+#include <unordered_map>
+#include <algorithm>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "Arena.h"
 
 using namespace std;
 
+// Interleaved per-pixel record of the row-major (format 0) and tiled
+// (format 1) data files; only read when upgrading them.
 struct PixelData
 {
 	uint64_t hits = 0;
@@ -17,48 +25,278 @@ struct PixelData
 	double realLast = 0, imagLast = 0;
 	uint64_t steps = 0, reachedStep = 0;
 	uint64_t startHits = 0, startSteps = 0;
+};
+
+enum Channel
+{
+	HITS, REALORIG, IMAGORIG, REALLAST, IMAGLAST, STEPS, REACHEDSTEP, STARTHITS, STARTSTEPS, CHANNELCOUNT
+};
+
+constexpr uint32_t channelBit(Channel c) { return 1u << c; }
+constexpr uint32_t ALLCHANNELS = (1u << CHANNELCOUNT) - 1;
+constexpr uint32_t ORIGINCHANNELS = channelBit(HITS) | channelBit(REALORIG) | channelBit(IMAGORIG);
+constexpr bool channelIsFloat(int c) { return c >= REALORIG && c <= IMAGLAST; }
+
+extern const char *channelNames[CHANNELCOUNT];
+
+// Which channels a job accumulates. A narrow profile keeps the hits of the
+// running step as uint32 and only widens a tile once it could overflow.
+struct AccumulatorProfile
+{
+	const char *name;
+	uint32_t channels;
+	bool narrowHits;
+};
+
+extern const vector<AccumulatorProfile> profiles;
+const AccumulatorProfile *findProfile(const string &name);
+string channelList(uint32_t channels);
+
+// Where a job seeds its orbits: on the refinement grid, along the Sobol or
+// R2 low-discrepancy sequence, or on the grid jittered within each cell.
+extern const vector<string> samplings;
+bool isSampling(const string &name);
+
+// Which orbits and points a job accumulates, applied by the kernels before
+// anything is stored: orbits of minLength to maxLength iterations (0 for no
+// upper bound) and of those every thin-th point. Points outside the image
+// are never stored.
+struct OrbitFilter
+{
+	int minLength = 0, maxLength = 0, thin = 1;
 
-	void load(FILE* file);
-	void save(FILE* file);
+	bool parse(const string &option);
+	// the options that give this filter, empty for the default
+	string str() const;
+	bool operator==(const OrbitFilter &o) const { return minLength == o.minLength && maxLength == o.maxLength && thin == o.thin; }
+	bool operator!=(const OrbitFilter &o) const { return !(*this == o); }
 };
 
+// Typed view on the columns of one pinned tile; channels that were not
+// requested on pin or are not stored are null. Narrow hits are only
+// reachable through hits32.
+struct PixelColumns
+{
+	uint64_t *hits = 0;
+	uint32_t *hits32 = 0;
+	double *realOrig = 0, *imagOrig = 0;
+	double *realLast = 0, *imagLast = 0;
+	uint64_t *steps = 0, *reachedStep = 0;
+	uint64_t *startHits = 0, *startSteps = 0;
+
+	uint64_t *words[CHANNELCOUNT] = {};
+};
+
+// A rectangle of one pyramid level with all channels, used to carry sums
+// from one level to the next.
+struct PixelBlock
+{
+	int x0 = 0, y0 = 0, w = 0, h = 0;
+	vector<uint64_t> columns[CHANNELCOUNT];
+
+	PixelColumns view();
+};
+
+// a channel of one tile, in arena memory
+typedef vector<uint64_t, ArenaAllocator<uint64_t>> Column;
+
+constexpr int TILESIZE = 256;
+constexpr size_t TILEMEMORY = 1024UL*1024*1024;
+constexpr int DATAFORMAT = 2;
+
+struct Tile
+{
+	Column columns[CHANNELCOUNT];
+	uint32_t loaded = 0, dirty = 0;
+	int pins = 0;
+	uint64_t lastUse = 0;
+	bool narrow = false;
+	uint64_t hitsBound = 0;
+};
+
+// Pages square tiles between memory and a file with one tile-major plane per
+// channel, so only the recently used tiles of the requested channels have to
+// be resident.
+//
+// After rewrite(), columns are written to a scratch file instead and read
+// back from there once written; the file keeps its contents until complete()
+// has copied the rest over and replace() puts the scratch file in its place.
+struct TileCache
+{
+	string filename, scratch;
+	long offset = 0;
+	uint32_t channels = ALLCHANNELS;
+	bool narrowHits = false;
+	int width = 0, height = 0;
+	int tilesX = 0, tilesY = 0;
+	size_t maxResident = 0, resident = 0;
+	uint64_t useClock = 0;
+	FILE *file = 0, *scratchFile = 0;
+	// per tile the channels already written to the scratch file
+	vector<uint32_t> moved;
+	vector<Tile> tiles;
+	mutex mtx, io;
+
+	~TileCache();
+
+	void open(string filename, int width, int height, uint32_t channels = ALLCHANNELS, long offset = 0);
+	void flush();
+	void close();
+	void discard();
+
+	void rewrite(string scratch);
+	bool rewriting() const { return !scratch.empty(); }
+	void complete();
+	void replace();
+
+	int tileCount() const { return tilesX * tilesY; }
+	int tileAt(int x, int y) const { return x / TILESIZE + y / TILESIZE * tilesX; }
+	void tileRect(int tile, int &x0, int &y0, int &w, int &h) const;
+	long tileOffset(int tile, int channel) const;
+
+	PixelColumns pin(int tile, uint32_t request, uint64_t hitsHeadroom = 0);
+	void unpin(int tile, uint32_t dirty = 0);
+	void forEach(uint32_t channels, function<void(int, int, int, int, PixelColumns&)> fn, uint32_t dirty = 0);
+	void parallelForEach(uint32_t channels, function<void(int, int, int, int, PixelColumns&)> fn, uint32_t dirty = 0);
+
+	void loadColumn(int tile, int channel);
+	void columnWords(int tile, int channel, Column &buffer);
+	void widenHits(int tile);
+	void writeColumn(int tile, int channel, Column &buffer);
+	bool evictOne();
+};
+
+// cache holds the orbits found since the last saveCallBack, each as a header
+// (c, 0, -1 - its length) followed by the points it contributes, (x, c,
+// the iteration of x).
 struct ThreadData
 {
-	vector<tuple<complex<double>, complex<double>, int>> cache;
+	vector<tuple<complex<double>, complex<double>, int>, ArenaAllocator<tuple<complex<double>, complex<double>, int>>> cache;
 	volatile int next;
+	// half the width and height of the window points are kept in, a little
+	// more than the union of the windows of the datasets they go to
+	double clipWidth = 0, clipHeight = 0;
 	function<void(void)> saveCallBack;
 };
 
+// Exact count of every value of an integer channel over one image, so
+// renders can rank values without sorting them. Small values are counted
+// in an array, larger ones in a hash map.
+struct ValueHistogram
+{
+	static constexpr uint64_t DENSE = 1 << 16;
+	vector<uint64_t> dense = vector<uint64_t>(DENSE);
+	unordered_map<uint64_t, uint64_t> sparse;
+
+	void clear();
+	void add(uint64_t value, uint64_t count = 1);
+	void remove(uint64_t value, uint64_t count = 1);
+
+	// values[i] changes by delta[i]
+	template<typename T>
+	void addDelta(const uint64_t *values, const T *delta, int n)
+	{
+		for(int i = 0; i < n; ++i)
+		{
+			if(!delta[i])
+				continue;
+			remove(values[i]);
+			add(values[i] + delta[i]);
+		}
+	}
+};
+
+// How many counted values lie below any value, built from a ValueHistogram.
+struct RankTable
+{
+	vector<uint64_t> dense;
+	vector<uint64_t> values, below;
+	uint64_t total = 0;
+
+	void build(const ValueHistogram &hist);
+	uint64_t rank(uint64_t value) const
+	{
+		if(value < ValueHistogram::DENSE)
+			return dense[value];
+		auto it = lower_bound(values.begin(), values.end(), value);
+		return it == values.end() ? total : below[it - values.begin()];
+	}
+};
+
+void halveBlock(const PixelBlock &src, PixelBlock &dst);
+
 struct StorageElement
 {
 	int uid;
+	string dir = "storage";
 
 	string formula;
 	int divergenceThreshold;
 	int width, height;
 	int steps, computedSteps, skipPoints;
 	double complexWidth, complexHeight;
+	int dataFormat = DATAFORMAT;
+	int shardIndex = 0, shardCount = 1;
+	int pyramidLevels = 0;
+	string profile = "full";
+	uint32_t channels = ALLCHANNELS;
+	bool narrowHits = false;
+	string sampling = "grid";
+	OrbitFilter filter;
+	// the resolution and window of the job whose orbits this dataset is a
+	// further target of; all 0 if it seeds its orbits itself
+	int seedWidth = 0, seedHeight = 0;
+	double seedComplexWidth = 0, seedComplexHeight = 0;
+	// the centre of the window; only targets can be off the origin
+	double centerReal = 0, centerImag = 0;
+	// (step, how much that step changed the equalized hits image) for every
+	// step after the first, saved with the header
+	vector<pair<int, double>> convergence;
 
 	bool headerSaved = true;
 
 	vector<uint8_t> divergenceTable;
 	int divUsage = 0;
 	bool divDirty = false;
-	vector<PixelData> data;
+	TileCache data;
 	int dataUsage = 0;
 	bool dataDirty = false;
+	// the step rewriteData is collecting the merge of
+	int rewrittenStep = 0;
+
+	// levels[k-1] holds pyramid level k, where every pixel sums a 2^k x 2^k
+	// block of data; they are opened and saved together with the data
+	vector<TileCache*> levels;
+	mutex pyramidMtx;
+
+	// hitsSummary[k] counts the hits values of pyramid level k; kept up to
+	// date by the end-of-step merge and guarded by pyramidMtx
+	vector<ValueHistogram> hitsSummary;
+	bool summaryValid = false, summaryDirty = false;
+
+	// the step a running calculation accumulates, published for live views;
+	// pendingVersion[t] changes whenever data tile t gets new samples
+	mutex liveMtx;
+	TileCache *pending = nullptr;
+	mutex *pendingMerge = nullptr;
+	vector<uint64_t> pendingVersion;
+	volatile double pendingProgress = 0;
 
 	mutex mtx;
 
 	void loadHeader();
 	void loadDivergenceTable();
 	void loadData();
-	void loadPauseData(vector<PixelData> &dat, uint64_t &stripe);
+	void loadPauseData(TileCache &dat, uint64_t &stripe);
 
 	void saveHeader();
 	void saveDivergenceTable();
 	void saveData();
-	void savePauseData(vector<PixelData> &dat, uint64_t stripe);
+	void savePauseData(TileCache &dat, uint64_t stripe);
+
+	void rewriteData();
+	void commitData();
+	void recoverCommit();
 
 	void aquireDivergenceTable();
 	void aquireData();
@@ -67,6 +305,27 @@ struct StorageElement
 	void releaseData();
 
 	void deletePauseData();
+	void upgradeDataFormat();
+	bool setProfile(const string &name);
+	bool seededBy(int w, int h, double cw, double ch) const;
+	bool centredAt(double re, double im) const;
+
+	int pyramidDepth() const;
+	int levelWidth(int k) const { return (width + (1 << k) - 1) >> k; }
+	int levelHeight(int k) const { return (height + (1 << k) - 1) >> k; }
+	int levelFor(int maxWidth, int maxHeight) const;
+	TileCache &level(int k) { return k ? *levels[k - 1] : data; }
+	void buildPyramid();
+	void updatePyramid(const PixelBlock &delta);
+
+	void loadSummary();
+	void saveSummary();
+	void loadConvergence();
+	void saveConvergence();
+	void buildSummary();
+
+	void publishPending(TileCache *cache, mutex *merge);
+	bool pendingTile(int tile, uint32_t channels, PixelBlock &out, uint64_t &version);
 };
 
 struct Storage
@@ -74,10 +333,20 @@ struct Storage
 	vector<StorageElement*> saves;
 	int uidC;
 
+	mutex saveMtx, queueMtx;
+	condition_variable queueCv;
+	thread ioThread;
+	bool savePending = false, saveRunning = false, ioQuit = false;
+
 	~Storage();
 
 	void load();
 	void save();
+	void saveAsync();
+	void sync();
+	void ioWorker();
+
+	StorageElement *mergeShards(const vector<string> &paths);
 };
 
 #endif
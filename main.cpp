@@ -11,13 +11,27 @@
 #include "FormulaManager.h"
 #include "Calculator.h"
 #include "RenderManager.h"
+#include "ControlServer.h"
+#include "Golden.h"
+#include "Isa.h"
 
 using namespace std;
 
 #define ISCMD(str, cmd) (str.substr(0, strlen(cmd)) == cmd)
 
+// how often, in milliseconds, waiting for input looks after the jobs
+constexpr int POLLINTERVAL = 200;
+
 GetLine *gl = 0;
 
+static Storage *store = 0;
+static RenderManager *renderMan = 0;
+static Calculator *calc = nullptr;
+static StorageElement *active = nullptr;
+static RenderCache renderCache;
+// calc lines waiting for the running job to end
+static vector<string> jobQueue;
+
 #define AUTO_CPL_SELECT(name, prev, source, source2)\
 		left = left.substr((prev).size());\
 		left.erase(left.begin(), find_if(left.begin(), left.end(), not1(ptr_fun<int,int>(isspace))));\
@@ -43,7 +57,7 @@ CPL_MATCH_FN(autocomp)
 	string cmd = l.substr(0, l.find_first_of(" \n\t"));
 	if(l == cmd)
 	{
-		static vector<string> cmds = {"calc", "list", "pause", "renderall", "save", "select", "stop", "view"};
+		static vector<string> cmds = {"calc", "list", "merge", "pause", "queue", "renderall", "save", "select", "stop", "sync", "view"};
 		for(auto c : cmds)
 		{
 			if(c.substr(0, cmd.size()) == cmd)
@@ -52,7 +66,7 @@ CPL_MATCH_FN(autocomp)
 			}
 		}
 	}
-	else if(cmd == "calc" || cmd == "select")
+	else if(cmd == "calc" || cmd == "select" || cmd == "queue")
 	{
 		string left = l;
 		AUTO_CPL_SELECT(formula, cmd, FormulaManager::formulas, x.first);
@@ -142,209 +156,520 @@ CPL_MATCH_FN(autocomp)
 	return 0;
 }
 
-int main(int argc, char** argv)
+// Reads the options after the eight job parameters: a shard, a profile, a
+// sampling, the orbit filter, further targets and, where frames and
+// converge are given, the time-lapse options and when to end the job.
+static bool parseJobOptions(const string &line, int &shard, int &shards, string &profile, string &sampling, OrbitFilter &filter, vector<TargetSpec> &targets, FrameOptions *frames = nullptr, ConvergeOptions *converge = nullptr)
 {
-	SDL_Init(SDL_INIT_EVERYTHING);
-	atexit(SDL_Quit);
-
-	FormulaManager::init();
-
-	string line;
-	char *lineBuf;
-
-	Storage store;
-	store.load();
-
-	RenderManager renderMan;
-
-	gl = new_GetLine(1024, 1024*1024);
-	gl_customize_completion(gl, (void*)&store, autocomp);
-	
-	printf("mbmanager initialized.\nUsage:\ncalc <formula> <w>x<h> <steps> <div> <skip> <cw> <ch>\n");
-
-	Calculator* calc = nullptr;
-	StorageElement* active = nullptr;
+	char token[512];
+	int pos = 0, len;
+	for(int i = 0; i < 8 && sscanf(line.c_str() + pos, " %511s%n", token, &len) == 1; ++i)
+		pos += len;
+	while(sscanf(line.c_str() + pos, " %511s%n", token, &len) == 1)
+	{
+		pos += len;
+		int a, b, n = 0;
+		if(sscanf(token, "%d/%d%n", &a, &b, &n) == 2 && !token[n])
+		{
+			shard = a;
+			shards = b;
+		}
+		else if(findProfile(token))
+			profile = token;
+		else if(isSampling(token))
+			sampling = token;
+		else if(filter.parse(token))
+			continue;
+		else if(!strncmp(token, "target=", 7) && TargetSpec().parse(token + 7))
+		{
+			targets.emplace_back();
+			targets.back().parse(token + 7);
+		}
+		else if(frames && frames->parse(token))
+			continue;
+		else if(converge && converge->parse(token))
+			continue;
+		else
+		{
+			fprintf(stderr, "unknown option '%s'\nKnown profiles:", token);
+			for(auto &p : profiles)
+				fprintf(stderr, " %s", p.name);
+			fprintf(stderr, "\nKnown samplings:");
+			for(auto &name : samplings)
+				fprintf(stderr, " %s", name.c_str());
+			fprintf(stderr, "\nOrbit filters: minorbit=<iterations> maxorbit=<iterations> thin=<n>\nTargets: target=<w>x<h>[:<cw>x<ch>][@<re>,<im>]\n");
+			return false;
+		}
+	}
+	return true;
+}
 
-	while ((lineBuf = gl_get_line(gl, "", 0, -1)))
+// Runs one command line of the REPL or the control socket; false if it
+// failed or is unknown.
+static bool runCommand(const string &line)
+{
+	if (ISCMD(line, "calc"))
 	{
-		line = lineBuf;
-		if (ISCMD(line, "calc"))
+		char formula[100] = "x=x*x+c";
+		int w = 800, h = 600, steps = 1000, div = 50, skip = 0, shard = 0, shards = 1;
+		double cw = 4, ch = 3;
+		string profile = "full", sampling = "grid";
+		OrbitFilter filter;
+		vector<TargetSpec> targets;
+		FrameOptions frames;
+		ConvergeOptions converge;
+		sscanf(line.c_str(), "calc %s %dx%d %d %d %d %lf %lf", formula, &w, &h, &steps, &div, &skip, &cw, &ch);
+		if(!parseJobOptions(line, shard, shards, profile, sampling, filter, targets, &frames, &converge))
+			return false;
+
+		if (calc) 
+		{
+			fprintf(stderr, "already calculating something.. aborting..\n");
+			return false;
+		}
+		else
 		{
-			char formula[100] = "x=x*x+c";
-			int w = 800, h = 600, steps = 1000, div = 50, skip = 0;
-			double cw = 4, ch = 3;
-			sscanf(line.c_str(), "calc %s %dx%d %d %d %d %lf %lf", formula, &w, &h, &steps, &div, &skip, &cw, &ch);
-
-			if (calc) 
-				fprintf(stderr, "already calculating something.. aborting..\n");
-			else
+			string extra = filter.str();
+			for(auto &t : targets)
+				extra += (extra.empty() ? "target=" : " target=") + t.str();
+			printf("--> calc %s %dx%d %d %d %d %lf %lf %d/%d %s %s%s%s\n", formula, w, h, steps, div, skip, cw, ch, shard, shards, profile.c_str(), sampling.c_str(), extra.empty() ? "" : " ", extra.c_str());
+
+			bool ok = true;
+			calc = new Calculator(formula, w, h, steps, div, skip, cw, ch, shard, shards, profile.c_str(), sampling.c_str(), filter, targets, &ok, store);
+			if(!ok)
 			{
-				printf("--> calc %s %dx%d %d %d %d %lf %lf\n", formula, w, h, steps, div, skip, cw, ch);
-
-				bool ok = true;
-				calc = new Calculator(formula, w, h, steps, div, skip, cw, ch, &ok, &store);
-				if(!ok)
+				delete calc;
+				calc = nullptr;
+				return false;
+			}
+			if(!frames.path.empty())
+			{
+				calc->recorder = new FrameRecorder;
+				if(!calc->recorder->start(calc->storageElem, frames))
 				{
+					delete calc->recorder;
 					delete calc;
 					calc = nullptr;
-					continue;
+					return false;
 				}
-				calc->startCalculation();
-				active = calc->storageElem;
 			}
+			calc->converge = converge;
+			calc->startCalculation();
+			active = calc->storageElem;
 		}
-		else if(ISCMD(line, "select"))
+	}
+	else if(ISCMD(line, "queue"))
+	{
+		string job = "calc" + line.substr(5);
+		if(job.find_first_not_of(" \t\n", 4) == string::npos)
 		{
-			char formula[100] = "x=x*x+c";
-			int w = 800, h = 600, steps = 1000, div = 50, skip = 0;
-			double cw = 4, ch = 3;
-			sscanf(line.c_str(), "select %s %dx%d %d %d %d %lf %lf", formula, &w, &h, &steps, &div, &skip, &cw, &ch);
-			printf("--> select %s %dx%d %d %d %d %lf %lf\n", formula, w, h, steps, div, skip, cw, ch);
-
-			bool found = false;
-			for (auto s : store.saves)
-			{
-				if (s->formula != formula)
-					continue;
-				if (s->width != w)
-					continue;
-				if (s->height != h)
-					continue;
-				if (s->steps != steps)
-					continue;
-				if (s->divergenceThreshold != div)
-					continue;
-				if (s->skipPoints != skip)
-					continue;
-				if (abs(s->complexHeight - ch) > 1e-9)
-					continue;
-				if (abs(s->complexWidth - cw) > 1e-9)
-					continue;
-
-				active = s;
-				found = true;
-				break;
-			}
-			if(found)
-				printf("selected.\n");
-			else
-				fprintf(stderr, "not found. create with 'calc'\n");
+			for(size_t i = 0; i < jobQueue.size(); ++i)
+				printf("%zu: %s\n", i + 1, jobQueue[i].c_str());
+			if(jobQueue.empty())
+				printf("no queued jobs\n");
+			return true;
 		}
-		else if(ISCMD(line, "stop"))
+		int shard = 0, shards = 1;
+		string profile, sampling;
+		OrbitFilter filter;
+		vector<TargetSpec> targets;
+		FrameOptions frames;
+		ConvergeOptions converge;
+		if(!parseJobOptions(job, shard, shards, profile, sampling, filter, targets, &frames, &converge))
+			return false;
+		jobQueue.push_back(job);
+		printf("queued as job %zu\n", jobQueue.size());
+	}
+	else if(ISCMD(line, "select"))
+	{
+		char formula[100] = "x=x*x+c";
+		int w = 800, h = 600, steps = 1000, div = 50, skip = 0, shard = 0, shards = 1;
+		double cw = 4, ch = 3;
+		string profile = "full", sampling = "grid";
+		OrbitFilter filter;
+		vector<TargetSpec> targets;
+		sscanf(line.c_str(), "select %s %dx%d %d %d %d %lf %lf", formula, &w, &h, &steps, &div, &skip, &cw, &ch);
+		if(!parseJobOptions(line, shard, shards, profile, sampling, filter, targets))
+			return false;
+		string extra = filter.str();
+		for(auto &t : targets)
+			extra += (extra.empty() ? "target=" : " target=") + t.str();
+		printf("--> select %s %dx%d %d %d %d %lf %lf %d/%d %s %s%s%s\n", formula, w, h, steps, div, skip, cw, ch, shard, shards, profile.c_str(), sampling.c_str(), extra.empty() ? "" : " ", extra.c_str());
+
+		// with a target, the dataset the job's orbits feed at that
+		// resolution and window
+		int seedW = 0, seedH = 0;
+		double seedCw = 0, seedCh = 0, re = 0, im = 0;
+		if(targets.size() > 1)
 		{
-			if(!calc)
-				fprintf(stderr, "no calculation running.. stopping nothing..\n");
-			else
-			{
-				printf("stopping... \n");
-				calc->stopCalculation();
-				delete calc;
-				calc = 0;
-				printf("stopping... done.\n");
-			}
+			fprintf(stderr, "select takes at most one target\n");
+			return false;
 		}
-		else if(ISCMD(line, "pause"))
+		if(targets.size())
 		{
-			if(!calc)
-				fprintf(stderr, "no calculation running.. pausing nothing..\n");
-			else
+			seedW = w;
+			seedH = h;
+			seedCw = cw;
+			seedCh = ch;
+			w = targets[0].width;
+			h = targets[0].height;
+			if(targets[0].complexWidth)
 			{
-				printf("pausing... \n");
-				calc->pauseCalculation();
-				delete calc;
-				calc = 0;
-				printf("pausing... done.\n");
+				cw = targets[0].complexWidth;
+				ch = targets[0].complexHeight;
 			}
+			re = targets[0].centerReal;
+			im = targets[0].centerImag;
 		}
-		else if(ISCMD(line, "view"))
+
+		bool found = false;
+		for (auto s : store->saves)
 		{
-			char renderType[512] = "hits";
-			sscanf(line.c_str(), "view %s", renderType);
-			
-			if(!active)
-			{
-				fprintf(stderr, "no active data set... aborting\nSelect one using 'select' or create one using 'calc'\n");
+			if (s->formula != formula)
+				continue;
+			if (s->width != w)
+				continue;
+			if (s->height != h)
+				continue;
+			if (s->steps != steps)
+				continue;
+			if (s->divergenceThreshold != div)
+				continue;
+			if (s->skipPoints != skip)
+				continue;
+			if (abs(s->complexHeight - ch) > 1e-9)
+				continue;
+			if (abs(s->complexWidth - cw) > 1e-9)
+				continue;
+			if (!s->centredAt(re, im))
+				continue;
+			if (s->shardIndex != shard || s->shardCount != shards)
+				continue;
+			if (s->profile != profile)
+				continue;
+			if (s->sampling != sampling)
 				continue;
+			if (s->filter != filter)
+				continue;
+			if (!s->seededBy(seedW, seedH, seedCw, seedCh))
+				continue;
+
+			active = s;
+			found = true;
+			break;
+		}
+		if(found)
+			printf("selected.\n");
+		else
+		{
+			fprintf(stderr, "not found. create with 'calc'\n");
+			return false;
+		}
+	}
+	else if(ISCMD(line, "stop"))
+	{
+		if(!calc)
+		{
+			fprintf(stderr, "no calculation running.. stopping nothing..\n");
+			return false;
+		}
+		else
+		{
+			printf("stopping... \n");
+			calc->stopCalculation();
+			if(calc->recorder)
+			{
+				calc->recorder->finish();
+				delete calc->recorder;
 			}
-			renderMan.addWindow(new ViewWindow(active, renderType));
+			delete calc;
+			calc = 0;
+			printf("stopping... done.\n");
 		}
-		else if(ISCMD(line, "save"))
+	}
+	else if(ISCMD(line, "pause"))
+	{
+		if(!calc)
 		{
-			char renderType[512] = "hits", filename[512] = "out.png";
-			sscanf(line.c_str(), "save %s %[^\n]", renderType, filename);
-			
-			if(!active)
+			fprintf(stderr, "no calculation running.. pausing nothing..\n");
+			return false;
+		}
+		else
+		{
+			printf("pausing... \n");
+			calc->pauseCalculation();
+			if(calc->recorder)
 			{
-				fprintf(stderr, "no active data set... aborting\nSelect one using 'select' or create one using 'calc'\n");
-				continue;
+				calc->recorder->finish();
+				delete calc->recorder;
 			}
-			auto vw = new ViewWindow(active, renderType);
-			vw->createToFile(filename);
+			delete calc;
+			calc = 0;
+			printf("pausing... done.\n");
+		}
+	}
+	else if(ISCMD(line, "sync"))
+	{
+		printf("waiting for background saves... \n");
+		store->sync();
+		printf("waiting for background saves... done.\n");
+	}
+	else if(ISCMD(line, "view"))
+	{
+		char renderType[512] = "hits", rest[512] = "", option[512];
+		int maxW = 0, maxH = 0, n = 0;
+		sscanf(line.c_str(), "view %s %[^\n]", renderType, rest);
+		if(sscanf(rest, "%dx%d%n", &maxW, &maxH, &n) == 2)
+			memmove(rest, rest + n, strlen(rest + n) + 1);
+		else
+			maxW = maxH = 0;
+		// palette=<file> is the only option a view takes
+		ExportOptions options;
+		bool ok = true;
+		while(ok && sscanf(rest, " %511s%n", option, &n) == 1)
+		{
+			ok = !strncmp(option, "palette=", 8) && options.parse(option);
+			if(!ok)
+				fprintf(stderr, "unknown view option '%s'\n", option);
+			memmove(rest, rest + n, strlen(rest + n) + 1);
+		}
+		if(!ok)
+			return false;
+		
+		if(!active)
+		{
+			fprintf(stderr, "no active data set... aborting\nSelect one using 'select' or create one using 'calc'\n");
+			return false;
+		}
+		if(!ViewWindow::checkChannels(active, renderType))
+			return false;
+		auto vw = new ViewWindow(active, renderType, maxW, maxH);
+		vw->exportOptions = options;
+		if(!vw->setColormap())
+		{
 			delete vw;
+			return false;
 		}
-		else if(ISCMD(line, "list"))
+		renderMan->addWindow(vw);
+	}
+	else if(ISCMD(line, "save"))
+	{
+		char renderType[512] = "hits", filename[512] = "out.png", rest[512] = "";
+		int maxW = 0, maxH = 0, n = 0;
+		sscanf(line.c_str(), "save %s %[^\n]", renderType, rest);
+		// optional maximum size in front of the file name
+		if(sscanf(rest, "%dx%d%n", &maxW, &maxH, &n) == 2 && isspace(rest[n]))
+			memmove(rest, rest + n, strlen(rest + n) + 1);
+		else
+			maxW = maxH = 0;
+		// export options like level=1 or depth=16, then the file name
+		ExportOptions options;
+		char option[512];
+		bool ok = true;
+		while(sscanf(rest, " %511s%n", option, &n) == 1 && strchr(option, '='))
 		{
-			for (auto s : store.saves)
+			if(!options.parse(option))
 			{
-				printf("%s %dx%d %d %d %d %lf %lf -> %d\n",
-						s->formula.c_str(),
-						s->width,
-						s->height,
-						s->steps,
-						s->divergenceThreshold,
-						s->skipPoints,
-						s->complexWidth,
-						s->complexHeight,
-						s->computedSteps);
+				fprintf(stderr, "unknown export option '%s'\n", option);
+				ok = false;
+				break;
 			}
+			memmove(rest, rest + n, strlen(rest + n) + 1);
+		}
+		if(!ok)
+			return false;
+		sscanf(rest, " %[^\n]", filename);
+		
+		if(!active)
+		{
+			fprintf(stderr, "no active data set... aborting\nSelect one using 'select' or create one using 'calc'\n");
+			return false;
+		}
+		auto vw = new ViewWindow(active, renderType, maxW, maxH);
+		vw->exportOptions = options;
+		string key = vw->cacheKey();
+		if(renderCache.lookup(filename, key))
+			printf("'%s' is up to date.\n", filename);
+		else if((ok = vw->setColormap() && vw->createToFile(filename)))
+		{
+			renderCache.record(filename, key);
+			renderCache.save();
+		}
+		delete vw;
+		return ok;
+	}
+	else if(ISCMD(line, "list"))
+	{
+		for (auto s : store->saves)
+		{
+			char shard[256] = "";
+			if (s->shardCount > 1)
+				sprintf(shard, " %d/%d", s->shardIndex, s->shardCount);
+			if (s->profile != "full")
+				sprintf(shard + strlen(shard), " %s", s->profile.c_str());
+			if (s->sampling != "grid")
+				sprintf(shard + strlen(shard), " %s", s->sampling.c_str());
+			if (s->filter != OrbitFilter())
+				sprintf(shard + strlen(shard), " %s", s->filter.str().c_str());
+			if (s->centerReal || s->centerImag)
+				sprintf(shard + strlen(shard), " at %.17g,%.17g", s->centerReal, s->centerImag);
+			if (s->seedWidth)
+				sprintf(shard + strlen(shard), " target of %dx%d %lf %lf", s->seedWidth, s->seedHeight, s->seedComplexWidth, s->seedComplexHeight);
+			char change[64] = "";
+			if (s->convergence.size())
+				sprintf(change, ", last step changed %.6f", s->convergence.back().second);
+			printf("%s %dx%d %d %d %d %lf %lf%s -> %d%s\n",
+					s->formula.c_str(),
+					s->width,
+					s->height,
+					s->steps,
+					s->divergenceThreshold,
+					s->skipPoints,
+					s->complexWidth,
+					s->complexHeight,
+					shard,
+					s->computedSteps,
+					change);
+		}
 
+	}
+	else if(ISCMD(line, "merge"))
+	{
+		if(calc)
+		{
+			fprintf(stderr, "you can not merge while having a calculation run\n");
+			return false;
 		}
-		else if(ISCMD(line, "renderall"))
+
+		vector<string> paths;
+		char path[512];
+		int pos = strlen("merge"), len;
+		while(sscanf(line.c_str() + pos, " %511s%n", path, &len) == 1)
 		{
-			if(calc)
-			{
-				fprintf(stderr, "you can not render all while having a calculation run\n");
-				continue;
-			}
+			paths.push_back(path);
+			pos += len;
+		}
 
+		auto merged = store->mergeShards(paths);
+		if(!merged)
+			return false;
+		active = merged;
+		printf("merged into dataset %d and selected it.\n", merged->uid);
+	}
+	else if(ISCMD(line, "renderall"))
+	{
+		if(calc)
+		{
+			fprintf(stderr, "you can not render all while having a calculation run\n");
+			return false;
+		}
 
-			char folder[512] = "render", renderType[512] = "all";
-			sscanf(line.c_str(), "renderall %s %[^\n]", folder, renderType);
-			
-			mkdir(folder, 0777);
-			
-			int counter = 0;
 
-			vector<string> types = {"hits", "fractal", "origin", "direction"};
-			if(renderType != "all"s)
-				types = {renderType};
+		char folder[512] = "render", renderType[512] = "all";
+		sscanf(line.c_str(), "renderall %s %[^\n]", folder, renderType);
+		
+		mkdir(folder, 0777);
+
+		BatchRenderer batch;
+		batch.folder = folder;
+		batch.datasets = store->saves;
+		batch.types = {"hits", "fractal", "origin", "direction"};
+		batch.skipUnsupported = renderType == "all"s;
+		batch.cache = &renderCache;
+		if(renderType != "all"s)
+			batch.types = {renderType};
+		renderCache.hits = renderCache.linked = renderCache.misses = 0;
+		batch.run();
+		renderCache.report();
+		renderCache.save();
+
+		printf("all done!\n");
+	}
+	else
+		return false;
+	return true;
+}
 
-			for(auto s : store.saves)
-			{
-				printf("%s %dx%d %d %d %d %lf %lf -> %d ... \n",
-						s->formula.c_str(),
-						s->width,
-						s->height,
-						s->steps,
-						s->divergenceThreshold,
-						s->skipPoints,
-						s->complexWidth,
-						s->complexHeight,
-						s->computedSteps);
-
-				
-				for(auto t : types)
-				{
-					ViewWindow(s, t).createToFile(folder + "/"s + to_string(counter) + ".png"s);
-					counter++;
+// Ends a job that converged and starts the next queued one once no job is
+// running; called while the REPL or the daemon waits for input.
+static void pollJobs()
+{
+	if(calc && calc->converged)
+		runCommand(calc->converge.pause ? "pause" : "stop");
+	while(!calc && jobQueue.size())
+	{
+		string job = jobQueue.front();
+		jobQueue.erase(jobQueue.begin());
+		printf("starting queued job, %zu left\n", jobQueue.size());
+		runCommand(job);
+	}
+	fflush(stdout);
+}
 
-					printf("\033]0;%d/%lu images created...\007", counter, store.saves.size() * types.size());
-				}
+static bool jobsDue()
+{
+	return calc ? calc->converged : !jobQueue.empty();
+}
 
-			}
-			printf("all done!\n");
-		}
+static GL_TIMEOUT_FN(pollTimeout)
+{
+	if(!jobsDue())
+		return GLTO_CONTINUE;
+	gl_normal_io(gl);
+	pollJobs();
+	return GLTO_REFRESH;
+}
+
+int main(int argc, char** argv)
+{
+	SDL_Init(SDL_INIT_EVERYTHING);
+	atexit(SDL_Quit);
+
+	selectIsa();
+	FormulaManager::init();
+
+	// mbmanager --golden <folder> [update] runs the regression check
+	if(argc >= 3 && !strcmp(argv[1], "--golden"))
+	{
+		GoldenRun golden;
+		golden.folder = argv[2];
+		golden.update = argc > 3 && !strcmp(argv[3], "update");
+		return golden.run() ? 0 : 1;
+	}
+
+	char *lineBuf;
+
+	Storage storage;
+	storage.load();
+	store = &storage;
+	renderCache.load();
 
+	RenderManager renderManager;
+	renderMan = &renderManager;
+
+	// mbmanager --daemon <socket> serves the commands on a socket instead
+	if(argc == 3 && !strcmp(argv[1], "--daemon"))
+	{
+		ControlServer server;
+		server.store = store;
+		server.execute = runCommand;
+		server.idle = pollJobs;
+		server.cache = &renderCache;
+		if(!server.open(argv[2]))
+			return 1;
+		server.run();
+		return 0;
+	}
+
+	gl = new_GetLine(1024, 1024*1024);
+	gl_customize_completion(gl, (void*)store, autocomp);
+	gl_inactivity_timeout(gl, pollTimeout, nullptr, 0, POLLINTERVAL * 1000000);
+	
+	printf("mbmanager initialized.\nUsage:\ncalc <formula> <w>x<h> <steps> <div> <skip> <cw> <ch> [<shard>/<shards>] [full|origin|hits] [grid|sobol|r2|jitter] [minorbit=<iterations>] [maxorbit=<iterations>] [thin=<n>] [target=<w>x<h>[:<cw>x<ch>][@<re>,<im>]]... [frames=<file.y4m|folder>] [frametype=<type>] [every=<stripes>] [converge=<change>[:pause]]\nqueue [<calc arguments>]\nsave <type> [<max w>x<max h>] [level=0-9] [filter=adaptive|none|sub|up|average|paeth] [strategy=default|filtered|huffman|rle|fixed] [depth=8|16] [palette=<file>] [stream=0|1] [scale=level|box] <file.png|file.pfm>\nview <type> [<max w>x<max h>] [palette=<file>]\n");
+
+	while ((lineBuf = gl_get_line(gl, "", 0, -1)))
+	{
+		runCommand(lineBuf);
 		fflush(stdout);
 	}
 